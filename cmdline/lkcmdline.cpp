@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include <memory>
+#include <chrono>
 
 #include <lk/absyn.h>
 #include <lk/env.h>
@@ -39,10 +40,141 @@ void fcall_in(  lk::invoke_t &cxt )
 	cxt.result().assign( lk::from_utf8( buf ) );	
 }
 
+static int run_bench( lk::bytecode &bc, lk::env_t &env )
+{
+	// DEBUG mode without breakpoints sends every instruction through the
+	// per-op debugging checks, which is the baseline for the NORMAL fast path
+	lk::vm::ExecMode modes[2] = { lk::vm::DEBUG, lk::vm::NORMAL };
+	const char *names[2] = { "checked loop (DEBUG)", "fast loop (NORMAL)" };
+	double elapsed[2];
+
+	for( int i=0;i<2;i++ )
+	{
+		lk::vm V;
+		V.load( &bc );
+		V.initialize( &env );
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool ok = V.run( modes[i] );
+		elapsed[i] = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+		if ( !ok )
+		{
+			printf("vm: %s\n", (const char*)V.error().c_str());
+			return -1;
+		}
+
+		size_t opcount[lk::__MaxOp];
+		V.get_opcount( opcount );
+		size_t nops = 0;
+		for( size_t k=0;k<lk::__MaxOp;k++ )
+			nops += opcount[k];
+
+		printf("%-22s %10.1f ms  %12lu ops\n", names[i], elapsed[i], (unsigned long)nops );
+	}
+
+	if ( elapsed[1] > 0 )
+		printf("speedup: %.2fx\n", elapsed[0] / elapsed[1] );
+
+	return 0;
+}
+
+static bool profile_run( lk::bytecode &bc, lk::env_t &env, size_t opcount[lk::__MaxOp], double *elapsed )
+{
+	lk::vm V;
+	V.load( &bc );
+	V.initialize( &env );
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool ok = V.run();
+	*elapsed = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+	if ( !ok )
+	{
+		printf("vm: %s\n", (const char*)V.error().c_str());
+		return false;
+	}
+
+	V.get_opcount( opcount );
+	return true;
+}
+
+static int run_profile( lk::bytecode &bc, lk::env_t &env )
+{
+	// bc is generated without the peephole pass, run it, then
+	// fuse it in place and run it again to compare dispatch counts
+	size_t before[lk::__MaxOp], after[lk::__MaxOp];
+	double elapsed[2];
+
+	if ( !profile_run( bc, env, before, &elapsed[0] ) )
+		return -1;
+
+	size_t nfused = lk::peephole( bc );
+
+	if ( !profile_run( bc, env, after, &elapsed[1] ) )
+		return -1;
+
+	size_t nbefore = 0, nafter = 0;
+	printf("\n%-10s %12s %12s\n", "opcode", "unfused", "fused" );
+	for( size_t i=0; lk::op_table[i].name != 0; i++ )
+	{
+		size_t k = (size_t)lk::op_table[i].op;
+		nbefore += before[k];
+		nafter += after[k];
+		if ( before[k] > 0 || after[k] > 0 )
+			printf("%-10s %12lu %12lu\n", lk::op_table[i].name, (unsigned long)before[k], (unsigned long)after[k] );
+	}
+
+	printf("%-10s %12lu %12lu\n", "total", (unsigned long)nbefore, (unsigned long)nafter );
+	printf("%lu superinstructions, %.1f ms unfused, %.1f ms fused\n", (unsigned long)nfused, elapsed[0], elapsed[1] );
+	return 0;
+}
+
+static int run_vm( lk::bytecode &bc, lk::env_t &env, bool bench )
+{
+	if ( bench )
+		return run_bench( bc, env );
+
+	lk::vm V;
+	V.load( &bc );
+	V.initialize( &env );
+	if ( !V.run() )
+	{
+		printf("vm: %s\n", (const char*)V.error().c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+static bool ends_with( const std::string &s, const char *suffix )
+{
+	size_t n = strlen( suffix );
+	return s.length() >= n && s.compare( s.length() - n, n, suffix ) == 0;
+}
+
+static bool read_source( const char *file, std::string &text )
+{
+	FILE *fp = fopen( file, "rb" );
+	if ( !fp ) return false;
+
+	char buf[4096];
+	size_t n;
+	while ( (n = fread( buf, 1, sizeof(buf), fp )) > 0 )
+		text.append( buf, n );
+
+	fclose( fp );
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	bool parse_only = false;
 	bool use_vm = true;
+	bool bench = false;
+	bool profile = false;
+	bool compile = false;
+	bool assembly = false;
 	
 	if ( argc <= 1 )
 	{
@@ -54,6 +186,55 @@ int main(int argc, char *argv[])
 	{
 		if( strcmp( argv[2], "--parse" ) == 0 ) parse_only = true;
 		if( strcmp( argv[2], "--eval" ) == 0 ) use_vm = false;
+		if( strcmp( argv[2], "--bench" ) == 0 ) bench = true;
+		if( strcmp( argv[2], "--profile" ) == 0 ) profile = true;
+		if( strcmp( argv[2], "--compile" ) == 0 ) compile = true;
+		if( strcmp( argv[2], "--asm" ) == 0 ) assembly = true;
+	}
+
+	lk::env_t env;
+	env.register_func( fcall_in );
+	env.register_func( fcall_out );
+	env.register_func( fcall_outln );
+
+	env.register_funcs( lk::stdlib_basic() );
+	env.register_funcs( lk::stdlib_string() );
+	env.register_funcs( lk::stdlib_math() );
+	env.register_funcs( lk::stdlib_thread() );
+
+	std::string script( argv[1] );
+	if ( ends_with( script, ".lkb" ) )
+	{
+		lk::bytecode bc;
+		lk_string err;
+		if ( !lk::load_bytecode( script, bc, 0, &err ) )
+		{
+			printf("load: %s\n", (const char*)err.c_str());
+			return -1;
+		}
+
+		return run_vm( bc, env, bench );
+	}
+
+	// scripts compiled earlier are kept in the LK_BYTECODE_CACHE directory, named after the hash of their source
+	unsigned long long hash = 0;
+	std::string cached;
+	const char *cache_dir = getenv( "LK_BYTECODE_CACHE" );
+	std::string source;
+	if ( use_vm && !parse_only && !profile && !assembly && (compile || cache_dir) && read_source( argv[1], source ) )
+	{
+		hash = lk::source_hash( source.c_str(), source.length() );
+		if ( cache_dir && !compile )
+		{
+			char name[32];
+			sprintf( name, "%016llx.lkb", hash );
+			cached = std::string( cache_dir ) + "/" + name;
+
+			lk::bytecode bc;
+			unsigned long long stored = 0;
+			if ( lk::load_bytecode( cached, bc, &stored ) && stored == hash )
+				return run_vm( bc, env, bench );
+		}
 	}
 	
 	lk::input_file p( argv[1] );
@@ -71,32 +252,47 @@ int main(int argc, char *argv[])
 		return -1;
 	
 	if ( parse_only ) return 0;
-	
-	lk::env_t env;
-	env.register_func( fcall_in );
-	env.register_func( fcall_out );
-	env.register_func( fcall_outln );
-
-	env.register_funcs( lk::stdlib_basic() );
-	env.register_funcs( lk::stdlib_string() );
-	env.register_funcs( lk::stdlib_math() );
 
 	if ( use_vm )
 	{
 		lk::codegen C;
+		C.infer_types( &env );
 		if ( C.generate( tree.get() ) )
 		{
-			lk::bytecode bc;
-			C.get( bc );
-			
-			lk::vm V;
-			V.load( &bc );
-			V.initialize( &env );
-			if ( !V.run() )
+			if ( assembly )
+			{
+				lk_string asm_text, bytecode_text;
+				C.textout( asm_text, bytecode_text );
+				printf( "%s", (const char*)asm_text.c_str() );
+				return 0;
+			}
+
+			if ( compile )
 			{
-				printf("vm: %s\n", (const char*)V.error().c_str());
-				return -1;
+				// script.lk compiles to script.lkb
+				size_t dot = script.rfind( '.' ), slash = script.find_last_of( "/\\" );
+				if ( dot != std::string::npos && slash != std::string::npos && dot < slash )
+					dot = std::string::npos;
+				std::string out = script.substr( 0, dot ) + ".lkb";
+				if ( !C.write( out, hash ) )
+				{
+					printf("codegen: %s\n", (const char*)C.error().c_str() );
+					return -1;
+				}
+				return 0;
 			}
+
+			lk::bytecode bc;
+			C.get( bc, !profile );
+
+			// imported files are not covered by the hash, so only self-contained scripts are cached
+			if ( !cached.empty() && bc.debuginfo.files().size() <= 1 )
+				lk::write_bytecode( bc, hash, cached );
+
+			if ( profile )
+				return run_profile( bc, env );
+
+			return run_vm( bc, env, bench );
 		}
 		else
 		{
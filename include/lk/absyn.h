@@ -26,6 +26,7 @@
 #define __lk_absyn_h
 
 #include <vector>
+#include <atomic>
 
 #include <unordered_map>
 
@@ -86,7 +87,7 @@ namespace lk {
 
     lk_string to_string(lk_char c);
 
-    extern int _node_alloc;
+    extern std::atomic<int> _node_alloc; ///< nodes not yet deleted, counted atomically as scripts may be parsed on several threads
 
     class attr_t {
     public:
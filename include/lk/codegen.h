@@ -46,11 +46,20 @@ namespace lk {
 
         lk_string error() { return m_errStr; }
 
+        /// turns on type inference for generate(): arithmetic and comparisons whose operands are proven
+        /// to be numbers are emitted as their number-only instructions (see number_op), and references to
+        /// variables proven to hold numbers are marked ':number' in textout().  functions registered in
+        /// env, if given, count as numbers where their documented signature returns a real, integer or boolean
+        void infer_types(env_t *env = 0);
+
         /// traverses tree and identifes node types to create instructions, variables, data structures, labels, etc
         bool generate(lk::node_t *root);
 
-        /// copies labels, constants, & identifers into bytecode
-        size_t get(bytecode &b);
+        /// copies labels, constants, & identifers into bytecode, optionally running the peephole pass, and verifies it
+        size_t get(bytecode &b, bool optimize = true);
+
+        /// like get(), but saves the bytecode to a .lkb file along with the hash of its source, see load_bytecode()
+        bool write(const lk_string &file, unsigned long long source_hash, bool optimize = true);
 
         /// writes the bytecode into assembly
         void textout(lk_string &assembly, lk_string &bytecode);
@@ -66,7 +75,7 @@ namespace lk {
 */
         struct instr {
             instr(srcpos_t sp, Opcode _op, int _arg, const char *lbl = 0)
-                    : pos(sp), op(_op), arg(_arg) {
+                    : pos(sp), op(_op), arg(_arg), number(false) {
                 label = 0;
                 if (lbl) label = new lk_string(lbl);
             }
@@ -83,6 +92,7 @@ namespace lk {
                 pos = cpy.pos;
                 op = cpy.op;
                 arg = cpy.arg;
+                number = cpy.number;
                 label = 0;
                 if (cpy.label)
                     label = new lk_string(*cpy.label);
@@ -97,6 +107,7 @@ namespace lk {
             Opcode op;
             int arg;
             lk_string *label;
+            bool number; ///< refers to a variable inferred to hold a number
         };
 
         /// functions as virtual stack
@@ -106,11 +117,27 @@ namespace lk {
         LabelMap m_labelAddr;
         std::vector<vardata_t> m_constData;
         std::vector<lk_string> m_idList;
+        /// indices into m_idList and m_constData, the latter keyed by a structural hash of the constant
+        typedef unordered_map<lk_string, int, lk_string_hash, lk_string_equal> IdMap;
+        IdMap m_idIndex;
+        typedef std::unordered_multimap<size_t, int> ConstMap;
+        ConstMap m_constIndex;
         int m_labelCounter;
         /// stores labels associated with loops: continueAddr for advancing loops, break for end
         std::vector<lk_string> m_breakAddr, m_continueAddr;
+        /// instruction ranges [begin,end) of generated function bodies, in order of completion
+        std::vector<std::pair<size_t, size_t> > m_funcRanges;
         lk_string m_errStr;
 
+        /// type inference, see infer_types().  m_numeric holds the variables inferred to hold numbers in
+        /// the main program and in each function body being generated, innermost last
+        typedef unordered_map<lk_string, bool, lk_string_hash, lk_string_equal> NameSet;
+        bool m_infer;
+        env_t *m_inferEnv;
+        std::vector<NameSet> m_numeric;
+        NameSet m_escaped;
+        NameSet m_returnsNumber;
+
         bool error(const char *fmt, ...);
 
         bool error(const lk_string &s);
@@ -130,6 +157,19 @@ namespace lk {
         int emit(srcpos_t pos, Opcode o, int arg = 0);                        ///< makes instructions & adds to m_asm
         int emit(srcpos_t pos, Opcode o, const lk_string &L);
 
+        /// infers which variables of the main program or a function body hold numbers and makes it the current scope
+        void infer_scope(lk::node_t *body, lk::list_t *params);
+
+        bool is_numeric(lk::node_t *n);
+
+        bool returns_number(const lk_string &func);
+
+        /// emits the instruction for a binary expression, its number-only form if both operands are proven to be numbers
+        void emit_binary(lk::expr_t *n, Opcode op);
+
+        /// rewrites references to a function's own locals into slot references
+        void resolve_slots(size_t begin, size_t end, size_t first_inner);
+
         bool initialize_const_vec(lk::list_t *v, vardata_t &vvec);        ///< creates vector vardata type
         bool initialize_const_hash(lk::list_t *v, vardata_t &vhash);        ///< creates hash vardata type
         bool pfgen_stmt(lk::node_t *root, unsigned int flags);
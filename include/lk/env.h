@@ -29,9 +29,12 @@
 #include <cstdio>
 #include <cstdarg>
 #include <exception>
+#include <cstring>
+#include <stdint.h>
 
 #include <lk/absyn.h>
 #include <lk/invoke.h>
+#include <lk/flathash.h>
 
 /// create and associate a doc_t from within cxt, an invoke_t, if cxt doesn't yet have one
 #define LK_DOC(fn, desc, sig) if (cxt.doc_mode()) { cxt.document( lk::doc_t(fn , "", desc, sig ) ); return; }
@@ -45,7 +48,10 @@ namespace lk {
 
     struct fcallinfo_t;
     struct bytecode;
-    typedef unordered_map<lk_string, vardata_t *, lk_string_hash, lk_string_equal> varhash_t;
+    /// table values are stored inline, see flathash_t
+    typedef flathash_t<vardata_t> varhash_t;
+    /// variables of an env_t, owned by it
+    typedef flathash_t<vardata_t *> envhash_t;
 
 /**
 * \class error_t
@@ -87,10 +93,69 @@ namespace lk {
 *
 * Vardata_t form the execution stack of the vm: stores identifiers and expressions,
 * arguments and results for function invocations, and operations.
+*
+* String, array and table values are reference counted and shared between copies.
+* The accessors that hand out modifiable data (vec, hash, index, lookup, ...) first
+* give the value its own payload if it is shared, so copies keep value semantics.
+* Because the data they return may still be written after the value is copied, they
+* also mark the payload unshareable: from then on copies of the value get their own.
+* The c-prefixed accessors (cvec, chash, cindex, clookup) are read only and never copy.
+*
+* Arrays are stored as packed doubles for as long as only numbers and nulls are stored
+* in them (see cnumvec). Accessors that return element pointers (vec, cvec, index, cindex)
+* convert a packed array to the generic form first.
 */
 
     class vardata_t {
     private:
+#ifdef LK_NANBOX
+        /** NaN-boxed value
+        *
+        * Numbers without flags are stored as themselves.  Everything else is a quiet NaN whose
+        * sign bit and the three bits below the quiet bit hold the data type, and whose low 48 bits
+        * hold an 8-byte aligned payload pointer with the flags in its lowest three bits.
+        * A number with flags, or NaN, is a NUMBER pointing to its value (null for NaN).
+        */
+        uint64_t m_bits;
+
+        static const uint64_t QNAN = 0x7FF8000000000000ULL;
+        static const uint64_t PTRMASK = 0x0000FFFFFFFFFFF8ULL;
+        static const uint64_t FLAGBITS = 0x7;
+        static const int FADDR_SHIFT = 3; ///< bytecode addresses are stored like aligned pointers
+
+        bool boxed() const { return (m_bits & QNAN) == QNAN; }
+
+        uint64_t flagbits() const { return boxed() ? (m_bits & FLAGBITS) : 0; }
+
+        static uint64_t box(unsigned char ty) {
+            return QNAN | ((uint64_t) (ty & 0x08) << 60) | ((uint64_t) (ty & 0x07) << 48);
+        }
+
+        void *ptr() const { return (void *) (uintptr_t) (m_bits & PTRMASK); }
+
+        void set_ptr(unsigned char ty, void *p) { m_bits = box(ty) | ((uint64_t) (uintptr_t) p & PTRMASK) | flagbits(); }
+
+        double dval() const {
+            if (boxed()) return boxed_dval();
+            double d;
+            memcpy(&d, &m_bits, sizeof(d));
+            return d;
+        }
+
+        /// stores a number in place if it is unflagged and not NaN, otherwise in its own box
+        void set_dval(double d) {
+            // a boxed value other than a number has already been released by the caller
+            if (d == d && (!boxed() || ((m_bits & FLAGBITS) == 0 && type() != NUMBER)))
+                memcpy(&m_bits, &d, sizeof(d));
+            else
+                set_boxed_dval(d);
+        }
+
+        double boxed_dval() const;
+
+        void set_boxed_dval(double d);
+
+#else
         unsigned char m_type;
         /** \union m_u
         *
@@ -103,10 +168,41 @@ namespace lk {
             double v;
         } m_u;
 
+        static const int FADDR_SHIFT = 0;
+
+        void *ptr() const { return m_u.p; }
+
+        void set_ptr(unsigned char ty, void *p) {
+            set_type(ty);
+            m_u.p = p;
+        }
+
+        double dval() const { return m_u.v; }
+
+        void set_dval(double d) {
+            set_type(NUMBER);
+            m_u.v = d;
+        }
+
+#endif
+
+        /// changes the type, keeping the flags; the payload is left to the caller
         void set_type(unsigned char ty);
 
         void assert_modify();
 
+        void unshare() const;
+
+        /// unshare() for data that is handed out, also marking the payload unshareable
+        void own() const;
+
+        /// modifiable elements and entries for use within vardata_t, which does not hold on to them
+        std::vector<vardata_t> &elements() const;
+
+        varhash_t &entries() const;
+
+        void unpack() const;
+
     public:
         /// Data Types
         static const unsigned char NULLVAL = 1;
@@ -133,15 +229,28 @@ namespace lk {
 
         ~vardata_t();
 
-        inline unsigned char type() const { return (m_type & TYPEMASK); }
+#ifdef LK_NANBOX
+        inline unsigned char type() const {
+            return boxed() ? (unsigned char) (((m_bits >> 60) & 0x08) | ((m_bits >> 48) & 0x07)) : NUMBER;
+        }
 
-        const char *typestr() const;
+        /// flags 1 to 3 are stored, see m_bits
+        void set_flag(unsigned char flag);
+
+        void clear_flag(unsigned char flag) { if (boxed()) m_bits &= ~((uint64_t) 0x01 << (flag - 1)); }
+
+        bool flagval(unsigned char flag) const { return boxed() && ((m_bits >> (flag - 1)) & 0x01); }
+#else
+        inline unsigned char type() const { return (m_type & TYPEMASK); }
 
         void set_flag(unsigned char flag) { m_type |= (0x01 << flag) << 4; }
 
         void clear_flag(unsigned char flag) { m_type &= ~((0x01 << flag) << 4); }
 
         bool flagval(unsigned char flag) const { return ((m_type >> flag) >> 4) & 0x01; }
+#endif
+
+        const char *typestr() const;
 
         bool as_boolean() const;
 
@@ -153,18 +262,30 @@ namespace lk {
 
         double as_number() const;
 
-        bool equals(vardata_t &rhs) const;
+        bool equals(const vardata_t &rhs) const;
 
-        bool lessthan(vardata_t &rhs) const;
+        bool lessthan(const vardata_t &rhs) const;
 
         void nullify(); ///< only function that override const-ness
 
         void deep_localize();
 
-        bool copy(vardata_t &rhs);
+        /// unpacks the packed arrays nested anywhere inside this array or table, but not this value
+        /// itself, so that copies of it can be read from several threads at once (see env_t::freeze)
+        void unpack_nested();
+
+        bool copy(const vardata_t &rhs); ///< never writes rhs, so shared constants can be copied from concurrently
+
+        /// copy() for an assignment, whose target may lie inside rhs as in  x[2] = x;  rhs then gets
+        /// copied as far as the target instead of shared, which would make it contain itself
+        bool store(const vardata_t &rhs);
+
+        /// gives this value its own copies of the shared arrays and tables that hold x, if any, so
+        /// that x can be given a copy of this value without it containing itself
+        void unshare_path(const vardata_t *x);
 
         vardata_t &operator=(const vardata_t &rhs) {
-            copy(const_cast<vardata_t &>(rhs));
+            copy(rhs);
             return *this;
         }
 
@@ -172,7 +293,7 @@ namespace lk {
         inline vardata_t &deref() const {
             vardata_t *p = const_cast<vardata_t *>(this);
             while (p->type() == REFERENCE) {
-                vardata_t *pref = reinterpret_cast<vardata_t *>(p->m_u.p);
+                vardata_t *pref = reinterpret_cast<vardata_t *>(p->ptr());
                 if (p == pref) throw error_t("self referential reference");
                 p = pref;
             }
@@ -188,8 +309,9 @@ namespace lk {
 
         void empty_vector();
 
-        void empty_hash();
+        void empty_hash(size_t n = 0); ///< with room for n entries
 
+        /// stores a copy of *val under key and deletes val
         void assign(const lk_string &key, vardata_t *val);
 
         void unassign(const lk_string &key);
@@ -203,32 +325,68 @@ namespace lk {
 
         void resize(size_t n);
 
+        void set_num(size_t idx, double d); ///< stores a number in an array element, growing the array as needed
+
         vardata_t *ref() const;
 
         double num() const;
 
-        lk_string str() const;
+        /// num() without the type check, for a value known to be a NUMBER
+        double num_value() const { return dval(); }
+
+        /// true for a number without flags, which set_num_value() may overwrite
+#ifdef LK_NANBOX
+        bool is_plain_num() const { return !boxed(); }
+#else
+        bool is_plain_num() const { return m_type == NUMBER; }
+#endif
+
+        /// assign(d) without its checks, for a plain number or for a stack value that holds
+        /// a number or a reference and so owns no payload
+        void set_num_value(double d) { set_dval(d); }
+
+        /// the string itself, valid until the value is next modified
+        const lk_string &str() const;
 
         expr_t *func() const;
 
         vardata_t *index(size_t idx) const; ///< returned variable inherits const-ness of parent
+        const vardata_t *cindex(size_t idx) const;
+
         size_t length() const;
 
         vardata_t *lookup(const lk_string &key) const; ///< returned variable inherits const-ness of parent
+        const vardata_t *clookup(const lk_string &key) const;
+
         fcallinfo_t *fcall() const;
 
         size_t faddr() const;
 
         std::vector<vardata_t> *vec() const;
 
+        const std::vector<vardata_t> *cvec() const;
+
+        const std::vector<double> *cnumvec() const; ///< elements of a packed array, 0 if not packed
+
+        static bool is_null_num(double x); ///< true for a null element in a packed array
+
+        void vec_assign(const double *arr, size_t n); ///< makes this a packed array of n numbers
+
         void vec_append(double d);
 
         void vec_append(const lk_string &s);
 
         void vec_append(const vardata_t vd);
 
+        void vec_extend(const vardata_t &v); ///< appends the elements of the array v
+
+        /// appends s to the string value, in place unless its storage is shared
+        void str_append(const lk_string &s);
+
         varhash_t *hash() const;
 
+        const varhash_t *chash() const;
+
         void hash_item(const lk_string &key, double d);
 
         void hash_item(const lk_string &key, const lk_string &s);
@@ -369,10 +527,10 @@ namespace lk {
         void *m_userData;
 
         // for threading existing bytecode
-        bytecode *m_bc;
+        const bytecode *m_bc;
 
     public:
-        invoke_t(env_t *e, vardata_t &result, void *user_data = 0, bytecode *bc = 0)
+        invoke_t(env_t *e, vardata_t &result, void *user_data = 0, const bytecode *bc = 0)
                 : m_docPtr(0), m_env(e), m_resultVal(result), m_hasError(false), m_userData(user_data), m_bc(bc) {}
 
         bool doc_mode();
@@ -385,7 +543,7 @@ namespace lk {
 
         void *user_data() { return m_userData; }
 
-        bytecode *bc() { return m_bc; }
+        const bytecode *bc() { return m_bc; }
 
 
         std::vector<vardata_t> &arg_list() { return m_argList; }
@@ -439,8 +597,11 @@ namespace lk {
     protected:
         env_t *m_parent;
 
-        varhash_t m_varHash;
-        varhash_t::iterator m_varIter;
+        envhash_t m_varHash;
+        envhash_t::iterator m_varIter;
+        size_t m_varRev; ///< incremented whenever a stored variable is deleted
+        bool m_frozen;
+        bool m_readonly; ///< frozen with read_only set
 
         funchash_t m_funcHash;
         std::vector<objref_t *> m_objTable;
@@ -461,12 +622,18 @@ namespace lk {
 
         void clear_vars();
 
+        /// removes all variables like clear_vars(), but nullifies them and hands them to pool for reuse
+        void release_vars(std::vector<vardata_t *> &pool);
+
         void clear_objs();
 
         void assign(const lk_string &name, vardata_t *value);
 
         void unassign(const lk_string &name);
 
+        /// removes a variable without deleting it, the caller takes ownership
+        vardata_t *detach(const lk_string &name);
+
         vardata_t *lookup(const lk_string &name, bool search_hierarchy);
 
         bool first(lk_string &key, vardata_t *&value);
@@ -475,12 +642,29 @@ namespace lk {
 
         unsigned int size();
 
+        /// changes whenever a variable pointer previously returned by lookup() may have been deleted
+        size_t revision() { return m_varRev; }
+
         void set_parent(env_t *p);
 
         env_t *parent();
 
+        /// the outermost environment that is not frozen, which holds the objects of scripts
         env_t *global();
 
+        /// a snapshot of the variables visible from here, innermost first, and of the functions
+        /// registered along the way.  the snapshot has no parent and is never modified, so any
+        /// number of threads can run scripts in environments below it at once: an environment
+        /// whose lookup() finds a variable in a frozen parent copies it into itself first.
+        /// with read_only set, the copies are constants and scripts may not assign global variables.
+        /// the caller deletes the snapshot
+        env_t *freeze(bool read_only = false);
+
+        bool frozen() const { return m_frozen; }
+
+        /// true below a snapshot frozen with read_only set
+        bool read_only() const;
+
         bool register_func(fcall_t f, void *user_data = 0);
 
         bool register_funcs(std::vector<fcall_t> l, void *user_data = 0);
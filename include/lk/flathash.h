@@ -0,0 +1,350 @@
+/***********************************************************************************************************************
+*  LK, Copyright (c) 2008-2017, Alliance for Sustainable Energy, LLC. All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+*  following conditions are met:
+*
+*  (1) Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*  disclaimer.
+*
+*  (2) Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+*  following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+*  (3) Neither the name of the copyright holder nor the names of any contributors may be used to endorse or promote
+*  products derived from this software without specific prior written permission from the respective party.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+*  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER, THE UNITED STATES GOVERNMENT, OR ANY CONTRIBUTORS BE LIABLE FOR
+*  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+*  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+*  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+*  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**********************************************************************************************************************/
+
+
+#ifndef __lk_flathash_h
+#define __lk_flathash_h
+
+#include <vector>
+#include <new>
+
+#include <lk/absyn.h>
+
+namespace lk {
+
+/** Insertion ordered hash table from strings to values stored inline.
+* \class flathash_t
+*
+* Entries live in segments that are never moved once allocated, so a pointer to a value stays
+* valid until its key is erased or the table is cleared.  Lookups probe an open addressed index
+* of entry pointers and cached hashes; growing the table only rebuilds that index. Erased entries
+* are reset and reused for later insertions.  Iteration follows insertion order.
+*
+* Tables built the same way, such as records created from one literal, hold each key at the same
+* position among their entries, so a lookup of a constant key can first try the position the key
+* was found at in the previous table, see find(key, hash, pos).
+*/
+    template<typename V>
+    class flathash_t {
+    public:
+        struct entry {
+            lk_string first;
+            V second;
+
+            size_t hash;
+            entry *prev, *next; ///< prev points to the entry itself while it is erased
+        };
+
+        template<typename E>
+        class iter {
+        public:
+            iter() : m_e(0) {}
+
+            iter(E *e) : m_e(e) {}
+
+            template<typename F>
+            iter(const iter<F> &rhs) : m_e(rhs.get()) {}
+
+            E &operator*() const { return *m_e; }
+
+            E *operator->() const { return m_e; }
+
+            iter &operator++() {
+                m_e = m_e->next;
+                return *this;
+            }
+
+            iter operator++(int) {
+                iter i(*this);
+                m_e = m_e->next;
+                return i;
+            }
+
+            template<typename F>
+            bool operator==(const iter<F> &rhs) const { return m_e == rhs.get(); }
+
+            template<typename F>
+            bool operator!=(const iter<F> &rhs) const { return m_e != rhs.get(); }
+
+            E *get() const { return m_e; }
+
+        private:
+            E *m_e;
+        };
+
+        typedef iter<entry> iterator;
+        typedef iter<const entry> const_iterator;
+
+        flathash_t() { init(); }
+
+        flathash_t(const flathash_t &rhs) {
+            init();
+            copy_from(rhs);
+        }
+
+        ~flathash_t() { release(); }
+
+        flathash_t &operator=(const flathash_t &rhs) {
+            if (this != &rhs) {
+                clear();
+                copy_from(rhs);
+            }
+            return *this;
+        }
+
+        /// number of keys, kept up to date by insertions and erasures
+        size_t size() const { return m_size; }
+
+        bool empty() const { return m_size == 0; }
+
+        iterator begin() { return iterator(m_head); }
+
+        iterator end() { return iterator(); }
+
+        const_iterator begin() const { return const_iterator(m_head); }
+
+        const_iterator end() const { return const_iterator(); }
+
+        static size_t hash_of(const lk_string &key) { return lk_string_hash()(key); }
+
+        iterator find(const lk_string &key) { return iterator(locate(key, hash_of(key))); }
+
+        const_iterator find(const lk_string &key) const { return const_iterator(locate(key, hash_of(key))); }
+
+        /// lookup with a hash already computed by hash_of()
+        iterator find(const lk_string &key, size_t hash) { return iterator(locate(key, hash)); }
+
+        const_iterator find(const lk_string &key, size_t hash) const { return const_iterator(locate(key, hash)); }
+
+        /// lookup that first checks the entry at position pos, as left by an earlier call for the same
+        /// key, and otherwise stores the position the key is found at in pos.  returns 0 if key is missing
+        V *find(const lk_string &key, size_t hash, size_t &pos) {
+            entry *e = locate_at(key, hash, pos);
+            return e ? &e->second : 0;
+        }
+
+        const V *find(const lk_string &key, size_t hash, size_t &pos) const {
+            const entry *e = locate_at(key, hash, pos);
+            return e ? &e->second : 0;
+        }
+
+        /// returns the value for key, inserting a default constructed value at the end if it is missing
+        V &operator[](const lk_string &key) {
+            size_t hash = hash_of(key);
+            if (entry *e = locate(key, hash))
+                return e->second;
+            return insert_new(key, hash)->second;
+        }
+
+        void erase(iterator it) {
+            entry *e = it.get();
+            size_t i = e->hash & m_mask;
+            while (m_index[i].e != e)
+                i = (i + 1) & m_mask;
+            m_index[i].e = tombstone();
+
+            if (e->prev) e->prev->next = e->next;
+            else m_head = e->next;
+            if (e->next) e->next->prev = e->prev;
+            else m_tail = e->prev;
+
+            m_size--;
+
+            e->first = lk_string();
+            e->second.~V();
+            new(&e->second) V();
+            e->prev = e;
+            e->next = m_free;
+            m_free = e;
+        }
+
+        size_t erase(const lk_string &key) {
+            iterator it = find(key);
+            if (it == end()) return 0;
+            erase(it);
+            return 1;
+        }
+
+        void clear() {
+            release();
+            init();
+        }
+
+        /// sizes the index and entry storage for n keys
+        void reserve(size_t n) {
+            if (n > m_capacity) add_segment(n - m_capacity);
+            if (n >= m_size && (n + 1) * 4 > (m_mask + 1) * 3)
+                rehash(n);
+        }
+
+    private:
+        struct slot {
+            entry *e; ///< null when empty
+            size_t hash;
+        };
+
+        struct segment {
+            entry *entries;
+            size_t count;
+        };
+
+        slot *m_index;
+        size_t m_mask; ///< index length - 1
+        size_t m_used; ///< index slots holding an entry or a tombstone
+        entry *m_head, *m_tail, *m_free;
+        size_t m_size;
+        std::vector<segment> m_segs;
+        size_t m_fill; ///< entries taken from the last segment
+        size_t m_capacity;
+
+        static entry *tombstone() {
+            static char t;
+            return reinterpret_cast<entry *>(&t);
+        }
+
+        void init() {
+            m_index = 0;
+            m_mask = m_used = m_size = 0;
+            m_head = m_tail = m_free = 0;
+            m_segs.clear();
+            m_fill = m_capacity = 0;
+        }
+
+        void release() {
+            for (size_t i = 0; i < m_segs.size(); i++)
+                delete[] m_segs[i].entries;
+            delete[] m_index;
+        }
+
+        entry *locate(const lk_string &key, size_t hash) const {
+            if (!m_index) return 0;
+            size_t i = hash & m_mask;
+            for (;;) {
+                const slot &s = m_index[i];
+                if (!s.e) return 0;
+                if (s.hash == hash && s.e != tombstone() && lk_string_equal()(s.e->first, key))
+                    return s.e;
+                i = (i + 1) & m_mask;
+            }
+        }
+
+        entry *locate_at(const lk_string &key, size_t hash, size_t &pos) const {
+            entry *e = nth(pos);
+            if (e && e->hash == hash && e->prev != e && lk_string_equal()(e->first, key))
+                return e;
+
+            e = locate(key, hash);
+            if (e) pos = position(e);
+            return e;
+        }
+
+        /// the entry at position pos in the order entries were allocated, 0 if there is none
+        entry *nth(size_t pos) const {
+            for (size_t i = 0; i < m_segs.size(); i++) {
+                if (pos < m_segs[i].count)
+                    return (i + 1 < m_segs.size() || pos < m_fill) ? &m_segs[i].entries[pos] : 0;
+                pos -= m_segs[i].count;
+            }
+            return 0;
+        }
+
+        size_t position(const entry *e) const {
+            size_t pos = 0;
+            for (size_t i = 0; i < m_segs.size(); i++) {
+                if (e >= m_segs[i].entries && e < m_segs[i].entries + m_segs[i].count)
+                    return pos + (size_t) (e - m_segs[i].entries);
+                pos += m_segs[i].count;
+            }
+            return pos;
+        }
+
+        void add_segment(size_t n) {
+            segment seg;
+            seg.entries = new entry[n]();
+            seg.count = n;
+            m_segs.push_back(seg);
+            m_fill = 0;
+            m_capacity += n;
+        }
+
+        entry *alloc() {
+            if (entry *e = m_free) {
+                m_free = e->next;
+                return e;
+            }
+            if (m_segs.empty() || m_fill == m_segs.back().count)
+                add_segment(m_capacity < 4 ? 4 : m_capacity);
+            return &m_segs.back().entries[m_fill++];
+        }
+
+        /// rebuilds the index for n keys, dropping tombstones
+        void rehash(size_t n) {
+            size_t len = 8;
+            while (len * 3 < (n + 1) * 4)
+                len <<= 1;
+
+            delete[] m_index;
+            m_index = new slot[len]();
+            m_mask = len - 1;
+            m_used = 0;
+            for (entry *e = m_head; e; e = e->next)
+                place(e);
+        }
+
+        void place(entry *e) {
+            size_t i = e->hash & m_mask;
+            while (m_index[i].e && m_index[i].e != tombstone())
+                i = (i + 1) & m_mask;
+            if (!m_index[i].e) m_used++;
+            m_index[i].e = e;
+            m_index[i].hash = e->hash;
+        }
+
+        entry *insert_new(const lk_string &key, size_t hash) {
+            if ((m_used + 1) * 4 > (m_mask + 1) * 3)
+                rehash(m_size + 1);
+
+            entry *e = alloc();
+            e->first = key;
+            e->hash = hash;
+            e->next = 0;
+            e->prev = m_tail;
+            if (m_tail) m_tail->next = e;
+            else m_head = e;
+            m_tail = e;
+            m_size++;
+            place(e);
+            return e;
+        }
+
+        void copy_from(const flathash_t &rhs) {
+            if (rhs.m_size == 0) return;
+            reserve(rhs.m_size);
+            for (const entry *s = rhs.m_head; s; s = s->next)
+                insert_new(s->first, s->hash)->second = s->second;
+        }
+    };
+}; // namespace lk
+
+#endif
@@ -128,6 +128,9 @@ struct __lk_invoke_t {
     lk_var_t (*call_result)(struct __lk_invoke_t *);
 
     const char *(*call)(struct __lk_invoke_t *, const char *name); // returns 0 on success, error message otherwise.
+
+    // added after 'call' so that extensions built against the earlier layout keep working
+    int (*get_number_vec)(struct __lk_invoke_t *, lk_var_t, double *, int len); // returns the count copied
 };
 
 // function table must look like
@@ -162,6 +165,7 @@ typedef void(*lk_invokable)(struct __lk_invoke_t *);
 #define lk_set_string(var, str) lk->set_string(lk, var, str)
 #define lk_set_number(var, val) lk->set_number(lk, var, val)
 #define lk_set_number_array(var, arr, len) lk->set_number_vec(lk, var, arr, len)
+#define lk_get_number_array(var, arr, len) lk->get_number_vec(lk, var, arr, len)
 #define lk_make_array(var) lk->make_vec(lk)
 #define lk_reserve(var, len) lk->reserve(lk, var, len)
 #define lk_append_number(var, val) lk->append_number(lk, var, val)
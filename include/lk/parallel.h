@@ -0,0 +1,182 @@
+/***********************************************************************************************************************
+*  LK, Copyright (c) 2008-2017, Alliance for Sustainable Energy, LLC. All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+*  following conditions are met:
+*
+*  (1) Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*  disclaimer.
+*
+*  (2) Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+*  following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+*  (3) Neither the name of the copyright holder nor the names of any contributors may be used to endorse or promote
+*  products derived from this software without specific prior written permission from the respective party.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+*  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER, THE UNITED STATES GOVERNMENT, OR ANY CONTRIBUTORS BE LIABLE FOR
+*  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+*  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+*  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+*  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**********************************************************************************************************************/
+
+#ifndef __lk_parallel_h
+#define __lk_parallel_h
+
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <exception>
+
+#include <lk/env.h>
+#include <lk/vm.h>
+
+namespace lk {
+
+/** The process-wide pool of worker threads that every parallel stdlib function runs its work on.
+* \class thread_pool
+*
+* Each worker owns a queue of tasks and a vm.  A worker runs the newest task of its own queue and,
+* once that is empty, steals the oldest task of another worker's queue.  Tasks submitted by a
+* task go on the queue of the worker running it; others are dealt out to the workers in turn.
+* The worker's vm is handed to every task it runs, so that tasks reuse its stack and frames
+* instead of constructing a vm each.
+*/
+    class thread_pool {
+    public:
+        /// a task, given the vm of the thread running it.  the vm may still hold the bytecode and
+        /// variables of an earlier task, so a task loads and initializes it before running anything.
+        /// a task records the errors of its items itself, with the items
+        typedef void (*task_func)(void *data, vm &v);
+
+        /// tasks that are waited for together
+        class group {
+        public:
+            group();
+
+            ~group() { finish(); }
+
+            /// returns once every task submitted with this group has finished.  the calling thread
+            /// runs queued tasks meanwhile, so tasks may themselves submit and wait for tasks.  if an
+            /// exception escaped any of the tasks, the first one is rethrown once all have finished
+            void wait();
+
+        private:
+            friend class thread_pool;
+
+            /// wait() without rethrowing
+            void finish();
+
+            std::atomic<size_t> m_pending; ///< tasks submitted and not yet finished
+            std::mutex m_lock;
+            std::exception_ptr m_error; ///< the first exception that escaped a task
+        };
+
+        /// the pool, started with one worker per hardware thread on first use
+        static thread_pool &instance();
+
+        /// replaces the workers with n new ones, 0 for one per hardware thread.  must not be called
+        /// while any task is queued or running
+        void set_size(size_t n);
+
+        size_t size();
+
+        void submit(group &g, task_func f, void *data);
+
+    private:
+        thread_pool();
+
+        struct task {
+            task_func func;
+            void *data;
+            group *owner;
+        };
+
+        struct worker {
+            std::mutex lock;
+            std::deque<task> tasks;
+            std::thread thread;
+            vm machine;
+        };
+
+        void start(size_t n);
+
+        void stop();
+
+        /// runs tasks on worker i until the pool stops
+        void work(size_t i);
+
+        /// takes the newest task of queue i or, failing that, the oldest task of another queue
+        bool take(size_t i, task &t);
+
+        void run(task &t, vm &v);
+
+        std::mutex m_resize; ///< serializes set_size()
+        std::vector<worker *> m_workers;
+        std::atomic<size_t> m_next; ///< queue the next task from outside the pool goes on
+        std::atomic<size_t> m_queued; ///< tasks in all queues
+        std::mutex m_sleep;
+        std::condition_variable m_wake; ///< signalled when a task is queued, a group finishes or the pool stops
+        bool m_stop;
+    };
+
+/** Runs one script for many sets of inputs.
+* \class sweep
+*
+* The script is compiled once.  Each case is a table of inputs, assigned as global variables
+* of its own run of the script before the run starts.  Cases run concurrently on a bounded
+* number of the thread_pool's workers, each loading the one shared bytecode into its vm.
+*/
+    class sweep {
+    public:
+        sweep();
+
+        /// parses and compiles the script, returning false with the errors in err if it does not compile
+        bool compile(const lk_string &script, lk_string *err = 0);
+
+        /// variables copied into each case's results; if none are given, all of its global variables
+        void set_outputs(const std::vector<lk_string> &names) { m_outputs = names; }
+
+        /// most cases run at once, 0 for as many as the thread pool has workers
+        void set_threads(size_t n) { m_threads = n; }
+
+        /// runs every case and returns once all have finished.  results[i] is a table of the outputs
+        /// of cases[i], which must each be a table, along with an 'error' entry if its run failed.
+        /// env, if given, supplies registered functions and variables: every run sees a frozen
+        /// snapshot of it (see env_t::freeze), so changes made by one run stay in that run
+        void run(const std::vector<vardata_t> &cases, std::vector<vardata_t> &results, env_t *env = 0);
+
+        /// runs one case on v, for callers scheduling cases themselves.  an env shared with runs
+        /// on other threads must be frozen
+        void run(vm &v, const vardata_t &input, vardata_t &result, env_t *env = 0) const;
+
+        const bytecode &get_bytecode() const { return m_bc; }
+
+    private:
+        struct job; ///< the cases of one run() and the next of them to start
+
+        /// runs cases of a job until none are left, as a thread_pool task
+        static void work(void *data, vm &v);
+
+        bytecode m_bc;
+        bool m_compiled;
+        std::vector<lk_string> m_outputs;
+        size_t m_threads;
+    };
+
+/// calls the script function at faddr of bc once for each of items, with the item as its argument,
+/// concurrently on the thread_pool.  results[i] is the value returned for items[i], or null with
+/// errors[i] set to the error if that call failed.  the function sees the functions registered
+/// in env and its variables as constants, as they were before the first call (see env_t::freeze),
+/// and fails if it assigns a global variable.  each call starts from that snapshot afresh
+    void parallel_call(const bytecode *bc, size_t faddr, const std::vector<vardata_t> &items,
+                       std::vector<vardata_t> &results, std::vector<lk_string> &errors, env_t *env);
+
+} // namespace lk
+
+#endif
@@ -25,6 +25,8 @@
 #ifndef __lk_vm_h
 #define __lk_vm_h
 
+#include <algorithm>
+
 #include <lk/absyn.h>
 #include <lk/env.h>
 
@@ -46,6 +48,22 @@ namespace lk {
         LCREF, ///< left-hand constant reference
         LGREF, ///< left-hand global reference
         FREF, CALL, TCALL, RET, END, SZ, KEYS, TYP, VEC, HASH,
+        RSREF, ///< right-hand slot reference (function local)
+        LSREF, ///< left-hand slot reference (function local)
+        ARGS, ///< builds __args for a function body that references it
+        TAILCALL, ///< call in return position, reusing the frame of the returning function
+        LIDX, ///< left-hand array element, growing the array to hold it
+        LKEY, ///< left-hand table entry, added if missing
+        ADDEQ, SUBEQ, MULEQ, DIVEQ, ///< compound assignment to the variable or element on top of the stack
+        // arithmetic and comparisons of operands codegen proved to be numbers, see number_op()
+        ADDN, SUBN, MULN, DIVN, LTN, GTN, LEN, GEN, NEN, EQN,
+        // superinstructions written by peephole(), see base_op()
+        LTJF, LEJF, GTJF, GEJF, EQJF, NEJF, ///< compare and jump if false
+        PSHADD, PSHSUB, ///< add/subtract a constant
+        INCL, DECL, ///< increment/decrement a local
+        STL, ///< store into a local
+        IDXW, ///< store into an array element
+        PSHKEY, ///< look up a constant table key
         __MaxOp
     };
     struct OpCodeEntry {
@@ -54,21 +72,172 @@ namespace lk {
     };
     extern OpCodeEntry op_table[];
 
+/// slot reference operands carry the frame slot in the low byte and the identifier
+/// index above it, so that an unbound slot can still be resolved by name
+    static const unsigned int SLOT_MAX = 0xFF;
+    static const unsigned int SLOT_IDENTIFIER_MAX = 0xFFFF;
+
+    inline unsigned int slot_arg(unsigned int slot, unsigned int iden) { return (iden << 8) | (slot & SLOT_MAX); }
+
+    inline unsigned int slot_index(size_t arg) { return (unsigned int) (arg & SLOT_MAX); }
+
+    inline unsigned int slot_identifier(size_t arg) { return (unsigned int) (arg >> 8); }
+
+/**
+* \class linetable
+*
+* Maps instruction addresses to source positions.  Consecutive instructions from the same
+* statement share one entry, stored as variable-length deltas from the entry before it, and
+* file names are kept once in a side table.  Every few entries the decoder state is saved
+* so that a lookup only decodes a handful of entries.
+*
+*/
+
+    class linetable {
+    public:
+        /// a run of consecutive instructions with the same source position
+        struct entry {
+            size_t begin, end; ///< instructions [begin,end)
+            int line, stmt, stmt_end;
+            size_t file; ///< index of the file name, see file()
+            size_t next; ///< where the following entry is encoded
+        };
+
+        linetable() { clear(); }
+
+        void clear();
+
+        /// appends the position of the next instruction
+        void push_back(const srcpos_t &pos);
+
+        /// number of instructions covered
+        size_t size() const { return m_size; }
+
+        /// finds the entry covering instruction ip, returns false if out of range
+        bool lookup(size_t ip, entry &e) const;
+
+        /// position of instruction ip, or srcpos_t::npos if out of range
+        srcpos_t at(size_t ip) const;
+
+        /// walks the entries in order
+        bool first(entry &e) const;
+
+        bool next(entry &e) const;
+
+        const lk_string &file(size_t index) const { return m_files[index]; }
+
+        /// index of a file name, or -1 if no instruction comes from it
+        int find_file(const lk_string &name) const;
+
+        /// encoded entries and file names, for serialization
+        const std::vector<unsigned char> &data() const { return m_data; }
+
+        const std::vector<lk_string> &files() const { return m_files; }
+
+        /// replaces the table with entries previously obtained from data() and files(),
+        /// covering size instructions.  returns false and leaves the table empty if they are malformed
+        bool assign(const unsigned char *data, size_t len, const std::vector<lk_string> &files, size_t size);
+
+    private:
+        struct checkpoint {
+            size_t offset; ///< where the entry is encoded
+            size_t begin; ///< its first instruction
+            entry prev; ///< the entry before it, its deltas are taken from
+        };
+
+        std::vector<unsigned char> m_data;
+        std::vector<checkpoint> m_index;
+        std::vector<lk_string> m_files;
+        size_t m_size;
+        size_t m_count; ///< number of entries
+        entry m_last;
+
+        bool decode(size_t offset, const entry &prev, entry &e) const;
+    };
+
 /**
 * \struct bytecode
 *
 * Stores instruction stack information. Operation to be done and on which argument is stored in program.
 * Constants store variable data types while identifiers are names of variables.
 *
+* Once generated or loaded, and run through peephole() and verify(), bytecode is read only: a vm
+* never writes it, so any number of vm instances, on any threads, can load and run the same
+* bytecode at once without copying it.
+*
 */
 
     struct bytecode {
+        bytecode() : verified(false), max_stack(0) {}
+
         std::vector<unsigned int> program;
         std::vector<vardata_t> constants;
         std::vector<lk_string> identifiers;
-        std::vector<srcpos_t> debuginfo;
+        linetable debuginfo;
+
+        /// set by verify(), which must be run again if the program, constants or identifiers change
+        bool verified;
+        size_t max_stack; ///< deepest the stack gets in the main program or in one function body
+        std::vector<bool> entries; ///< instructions function bodies start at
     };
 
+/// a superinstruction replaces the first instruction of a sequence and keeps its operand;
+/// the instructions it absorbs stay in the program, so jumps into the middle of a fused
+/// sequence, debuginfo and breakpoints are unaffected.  returns the base instruction
+/// for a superinstruction or a number-only instruction, or op itself otherwise.
+    Opcode base_op(Opcode op);
+
+/// the number-only form of ADD, SUB, MUL, DIV or a comparison, or op itself for any other
+/// instruction.  codegen emits it where type inference proved both operands to be numbers.
+/// the vm trusts that proof and skips the type checks of the base instruction, but only in
+/// NORMAL mode for verified bytecode, and read_bytecode() turns loaded ones back into their
+/// base instructions, since nothing in a file proves the operand types
+    Opcode number_op(Opcode op);
+
+/// peephole pass fusing common instruction sequences in the program into superinstructions,
+/// which are executed in NORMAL mode only.  returns the number of sequences fused.
+    size_t peephole(bytecode &b);
+
+/// checks, for the main program and every function body, that each instruction finds enough
+/// values on the stack whichever way it is reached, that constant and identifier operands are in
+/// range, and that jumps and function addresses stay within the program.  on success b.verified
+/// is set and the vm runs b in NORMAL mode without checking these on every instruction.
+/// bytecode that fails is still run, with the checks.
+    bool verify(bytecode &b, lk_string *err = 0);
+
+/** Serialized bytecode (.lkb)
+*
+* Bytecode can be saved to a file and run later without lexing, parsing or generating
+* code again.  The file starts with a header holding the format version and a hash of
+* the source text the bytecode was generated from, followed by the program, constants,
+* identifiers and debug info.  Numbers are stored in the byte order of the machine that
+* wrote the file; files written in another byte order or format version are rejected,
+* and the caller is expected to fall back to compiling the source.
+*
+* Hosts keeping a cache directory of compiled scripts can name the files after
+* source_hash() of the script and compare it with the hash stored in the file.
+*/
+
+    static const unsigned int LKB_VERSION = 4;
+
+/// 64-bit FNV-1a hash of source text
+    unsigned long long source_hash(const char *text, size_t len);
+
+    unsigned long long source_hash(const lk_string &text);
+
+/// serializes b into buf, returns false if a constant cannot be serialized
+    bool write_bytecode(const bytecode &b, unsigned long long hash, std::vector<unsigned char> &buf,
+                        lk_string *err = 0);
+
+    bool write_bytecode(const bytecode &b, unsigned long long hash, const lk_string &file, lk_string *err = 0);
+
+/// deserializes bytecode written by write_bytecode, optionally returning the stored source hash
+    bool read_bytecode(const unsigned char *data, size_t len, bytecode &b, unsigned long long *hash = 0,
+                       lk_string *err = 0);
+
+/// reads a .lkb file, which is memory mapped rather than copied where the platform allows it
+    bool load_bytecode(const lk_string &file, bytecode &b, unsigned long long *hash = 0, lk_string *err = 0);
+
 #define OP_PROFILE 1
 
 // takes bytecode as input
@@ -93,8 +262,25 @@ namespace lk {
 *
 */
         struct frame {
-            frame(lk::env_t *parent, size_t fptr, size_t ret, size_t na)
-                    : env(parent), fp(fptr), retaddr(ret), nargs(na), iarg(0), thiscall(false) {
+            frame(lk::env_t *parent, size_t fptr, size_t ret, size_t na, size_t cip = 0)
+                    : env(parent), fp(fptr), retaddr(ret), nargs(na), iarg(0), thiscall(false), callip(cip),
+                      slotrev(0) {
+            }
+
+            /// prepares a frame released by an earlier call for reuse, its variables already cleared
+            void reset(lk::env_t *parent, size_t fptr, size_t ret, size_t na, size_t cip) {
+                env.set_parent(parent);
+                fp = fptr;
+                retaddr = ret;
+                nargs = na;
+                iarg = 0;
+                thiscall = false;
+                callip = cip;
+                id.clear();
+                std::fill(slots.begin(), slots.end(), (vardata_t *) 0);
+                slotrev = env.revision();
+                inherited.clear();
+                retired.clear();
             }
 
             lk::env_t env;
@@ -103,15 +289,28 @@ namespace lk {
             size_t nargs;
             size_t iarg;
             bool thiscall;
-            lk_string id;
+            size_t callip; ///< address of the call instruction, from which id is named
+            lk_string id; ///< function name, filled in by get_frames()
+
+            /// locals resolved by codegen to slot indices: each entry caches the variable
+            /// stored in env, which remains the owner so callees and debuggers still see it
+            std::vector<vardata_t *> slots;
+            size_t slotrev; ///< env revision the slots were bound against
+
+            /// variables of the function a tail call replaced, which the running function sees
+            /// as if they were in its parent frame until it binds the same name itself
+            std::vector<vardata_t *> inherited;
+            std::vector<vardata_t *> retired; ///< inherited variables shadowed since, freed by the next tail call or return
         };
 
     private:
         size_t ip;
         int sp; ///< stack size, use int so that values can go negative and errors easier to catch rather than wrapping around to a large number
-        std::vector<vardata_t> stack;
+        std::vector<vardata_t> stack; ///< grows on demand, see grow_stack()
+        size_t maxstack; ///< most entries the stack may grow to
+        size_t maxdepth; ///< most nested function calls, 0 for no limit
 
-        bytecode *bc;
+        const bytecode *bc; ///< shared, never written by the vm: per-run state such as breakpoints and key caches lives here
         /*
         std::vector< unsigned int > program;
         std::vector< vardata_t > constants;
@@ -120,13 +319,58 @@ namespace lk {
         */
 
         std::vector<frame *> frames;
+        std::vector<frame *> framepool; ///< frames released by returning calls, reused by later ones
+        std::vector<vardata_t *> varpool; ///< cleared variables released along with those frames
         std::vector<bool> brkpt; ///< breakpoints for debugging
 
+        /// call arguments read by value from packed arrays, bound to the array element
+        /// when the call turns out to be to an LK function, which may assign its arguments
+        struct elemarg {
+            size_t slot;
+            vardata_t *arr;
+            size_t index;
+        };
+        std::vector<elemarg> elemargs;
+
+        /// inline cache of a PSHKEY instruction: the hash of its key, and the position of
+        /// the key among the entries of the table it was last found in
+        struct keycache {
+            keycache() : hash(0), pos(0), hashed(false) {}
+
+            size_t hash;
+            size_t pos;
+            bool hashed;
+        };
+        std::vector<keycache> keycaches; ///< by instruction address
+
         lk_string errStr;
-        srcpos_t lastbrk;
+
+        /// statement and file index where the last STEP stopped
+        int brkstmt;
+        size_t brkfile;
+
+        /// position of the instruction last asked for, and the entry it came from
+        srcpos_t curpos;
+        linetable::entry curentry;
+
+        const srcpos_t &position(size_t addr);
 
         void free_frames();
 
+        bool grow_stack();
+
+        bool reserve_stack(size_t n);
+
+        vardata_t *new_var();
+
+        void recycle_var(vardata_t *x);
+
+        void bind_local(frame &F, const lk_string &name, vardata_t *x);
+
+        bool tail_call(size_t nargs);
+
+        lk_string frame_id(const frame &F);
+
         bool error(const char *fmt, ...);
 
 
@@ -146,14 +390,37 @@ namespace lk {
             SINGLE    ///< step 1 assembly instruction
         };
 
-        vm(size_t ssize = 4096);
+    private:
+        /// set when verified code calls a function the verifier has not seen
+        bool unverified_call;
+
+        template<bool checked, bool verified>
+        bool exec(ExecMode mode);
+
+    public:
+        /// the stack starts out with ssize entries and doubles whenever it fills, up to the
+        /// limit given by set_limits(), which is never below ssize
+        vm(size_t ssize = 256);
 
         virtual ~vm();
 
+        /// sets the most entries the stack may grow to, and the most nested function calls
+        /// allowed (0 for no limit).  exceeding either stops the script with an error
+        void set_limits(size_t max_stack, size_t max_depth = 0);
+
+        size_t get_max_stack() { return maxstack; }
+
+        size_t get_max_depth() { return maxdepth; }
+
         bool initialize(lk::env_t *env);
 
         bool run(ExecMode mode = NORMAL);
 
+        /// calls the script function at faddr, a function body of the loaded bytecode, with args instead
+        /// of running the program from the start.  the vm must be initialized, and the function sees the
+        /// variables of the environment given to initialize() as its globals
+        bool call(size_t faddr, const std::vector<vardata_t> &args, vardata_t &result);
+
         lk_string error() { return errStr; }
 
         virtual bool on_run(const srcpos_t &spos);
@@ -170,9 +437,9 @@ namespace lk {
 
         vardata_t *get_stack(size_t *psp);
 
-        void load(bytecode *b);
+        void load(const bytecode *b);
 
-        bytecode *get_bytecode() { return bc; }
+        const bytecode *get_bytecode() { return bc; }
 
         virtual bool special_set(const lk_string &name, vardata_t &val);
 
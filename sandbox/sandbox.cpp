@@ -301,7 +301,7 @@ public:
             m_asm->SetSelection(ip);
 
         if (ip < bc.debuginfo.size()) {
-            int line = bc.debuginfo[ip].stmt;
+            int line = bc.debuginfo.at(ip).stmt;
             if (line > 0 && line <= m_code->GetNumberOfLines()) {
                 int nnl = m_code->LinesOnScreen();
 
@@ -150,7 +150,7 @@ bool lk::convert_double(const lk_string &str, double *x)
 
 #endif
 
-int lk::_node_alloc = 0;
+std::atomic<int> lk::_node_alloc(0);
 
 const char *lk::expr_t::operstr() {
     switch (oper) {
@@ -47,32 +47,345 @@ namespace lk {
 // context flags for pfgen()
 #define F_NONE 0x00
 #define F_MUTABLE 0x01
+#define F_REFERENCE 0x02 ///< element used by reference: a call argument, the object of a method call or the operand of -@
 
     codegen::codegen() {
         m_labelCounter = 1;
+        m_infer = false;
+        m_inferEnv = 0;
+    }
+
+    void codegen::infer_types(env_t *env) {
+        m_infer = true;
+        m_inferEnv = env;
+        m_returnsNumber.clear();
+    }
+
+/// true if the function body refers to __args, so that calls only build it where it is used.
+/// nested function definitions get their own __args and are not searched.
+    static bool references_args(lk::node_t *root) {
+        if (!root)
+            return false;
+
+        if (lk::list_t *n = dynamic_cast<lk::list_t *>(root)) {
+            for (size_t i = 0; i < n->items.size(); i++)
+                if (references_args(n->items[i]))
+                    return true;
+        } else if (lk::iter_t *n = dynamic_cast<lk::iter_t *>(root)) {
+            return references_args(n->init) || references_args(n->test)
+                   || references_args(n->adv) || references_args(n->block);
+        } else if (lk::cond_t *n = dynamic_cast<lk::cond_t *>(root)) {
+            return references_args(n->test) || references_args(n->on_true) || references_args(n->on_false);
+        } else if (lk::expr_t *n = dynamic_cast<lk::expr_t *>(root)) {
+            if (n->oper != lk::expr_t::DEFINE)
+                return references_args(n->left) || references_args(n->right);
+        } else if (lk::iden_t *n = dynamic_cast<lk::iden_t *>(root)) {
+            return n->name == "__args";
+        } else if (lk::ctlstmt_t *n = dynamic_cast<lk::ctlstmt_t *>(root)) {
+            return references_args(n->rexpr);
+        }
+
+        return false;
+    }
+
+    typedef unordered_map<lk_string, bool, lk_string_hash, lk_string_equal> name_set;
+
+/// adds the variables that the value of an expression may be a reference to, as when it is passed
+/// to a function: an identifier, or an assignment or increment of one, which leave the variable
+    static void value_refs(lk::node_t *root, name_set &out) {
+        if (lk::iden_t *n = dynamic_cast<lk::iden_t *>(root)) {
+            out[n->name] = true;
+        } else if (lk::cond_t *n = dynamic_cast<lk::cond_t *>(root)) {
+            value_refs(n->on_true, out);
+            value_refs(n->on_false, out);
+        } else if (lk::expr_t *n = dynamic_cast<lk::expr_t *>(root)) {
+            switch (n->oper) {
+                case lk::expr_t::ASSIGN: case lk::expr_t::PLUSEQ: case lk::expr_t::MINUSEQ:
+                case lk::expr_t::MULTEQ: case lk::expr_t::DIVEQ: case lk::expr_t::INCR: case lk::expr_t::DECR:
+                case lk::expr_t::LOGIOR: case lk::expr_t::LOGIAND:
+                    value_refs(n->left, out);
+                    break;
+                case lk::expr_t::SWITCH:
+                    value_refs(n->right, out);
+                    break;
+                default:
+                    break;
+            }
+        } else if (lk::list_t *n = dynamic_cast<lk::list_t *>(root)) {
+            for (size_t i = 0; i < n->items.size(); i++)
+                value_refs(n->items[i], out);
+        }
+    }
+
+/// collects the variables that may be changed by reference anywhere in the program, nested functions
+/// included: call arguments, objects of method calls, operands of -@, and globals
+    static void collect_escaped(lk::node_t *root, name_set &out) {
+        if (!root)
+            return;
+
+        if (lk::list_t *n = dynamic_cast<lk::list_t *>(root)) {
+            for (size_t i = 0; i < n->items.size(); i++)
+                collect_escaped(n->items[i], out);
+        } else if (lk::iter_t *n = dynamic_cast<lk::iter_t *>(root)) {
+            collect_escaped(n->init, out);
+            collect_escaped(n->test, out);
+            collect_escaped(n->adv, out);
+            collect_escaped(n->block, out);
+        } else if (lk::cond_t *n = dynamic_cast<lk::cond_t *>(root)) {
+            collect_escaped(n->test, out);
+            collect_escaped(n->on_true, out);
+            collect_escaped(n->on_false, out);
+        } else if (lk::expr_t *n = dynamic_cast<lk::expr_t *>(root)) {
+            if (n->oper == lk::expr_t::CALL || n->oper == lk::expr_t::THISCALL) {
+                value_refs(n->right, out);
+                lk::expr_t *lexpr = dynamic_cast<lk::expr_t *>(n->left);
+                if (n->oper == lk::expr_t::THISCALL && lexpr)
+                    value_refs(lexpr->left, out);
+            } else if (n->oper == lk::expr_t::MINUSAT)
+                value_refs(n->left, out);
+
+            collect_escaped(n->left, out);
+            collect_escaped(n->right, out);
+        } else if (lk::iden_t *n = dynamic_cast<lk::iden_t *>(root)) {
+            if (n->globalval || n->special)
+                out[n->name] = true;
+        } else if (lk::ctlstmt_t *n = dynamic_cast<lk::ctlstmt_t *>(root)) {
+            collect_escaped(n->rexpr, out);
+        }
+    }
+
+/// how the variables of one scope are used, see codegen::infer_scope()
+    struct scope_uses {
+        name_set first; ///< true for a variable first used by an assignment that always runs
+        name_set changed; ///< variables changed other than by assigning them a value
+        std::vector<std::pair<lk_string, lk::node_t *> > values; ///< values assigned to variables, also by +=
+    };
+
+    static void note_use(scope_uses &u, const lk_string &name, bool assigned) {
+        if (u.first.find(name) == u.first.end())
+            u.first[name] = assigned;
+    }
+
+    static void scan_scope(lk::node_t *root, bool always, scope_uses &u);
+
+/// the target of an assignment to an element, which makes the variable holding the container an array or table
+    static void scan_target(lk::node_t *root, bool always, scope_uses &u) {
+        lk::expr_t *n = dynamic_cast<lk::expr_t *>(root);
+        if (n && (n->oper == lk::expr_t::INDEX || n->oper == lk::expr_t::HASH)) {
+            scan_target(n->left, always, u);
+            scan_scope(n->right, always, u);
+        } else if (lk::iden_t *id = dynamic_cast<lk::iden_t *>(root)) {
+            note_use(u, id->name, false);
+            u.changed[id->name] = true;
+        } else
+            scan_scope(root, always, u);
+    }
+
+/// visits a scope in the order codegen evaluates it, noting for each variable whether its first use is an
+/// assignment that runs whenever the scope does, and the values assigned to it.  nested function bodies
+/// are scopes of their own and skipped
+    static void scan_scope(lk::node_t *root, bool always, scope_uses &u) {
+        if (!root)
+            return;
+
+        if (lk::list_t *n = dynamic_cast<lk::list_t *>(root)) {
+            for (size_t i = 0; i < n->items.size(); i++)
+                scan_scope(n->items[i], always, u);
+        } else if (lk::iter_t *n = dynamic_cast<lk::iter_t *>(root)) {
+            scan_scope(n->init, always, u);
+            scan_scope(n->test, always, u);
+            scan_scope(n->block, false, u);
+            scan_scope(n->adv, false, u);
+        } else if (lk::cond_t *n = dynamic_cast<lk::cond_t *>(root)) {
+            scan_scope(n->test, always, u);
+            scan_scope(n->on_true, false, u);
+            scan_scope(n->on_false, false, u);
+        } else if (lk::expr_t *n = dynamic_cast<lk::expr_t *>(root)) {
+            switch (n->oper) {
+                case lk::expr_t::DEFINE:
+                    break;
+                case lk::expr_t::ASSIGN:
+                case lk::expr_t::PLUSEQ:
+                case lk::expr_t::MINUSEQ:
+                case lk::expr_t::MULTEQ:
+                case lk::expr_t::DIVEQ:
+                    scan_scope(n->right, always, u);
+                    if (lk::iden_t *id = dynamic_cast<lk::iden_t *>(n->left)) {
+                        note_use(u, id->name, n->oper == lk::expr_t::ASSIGN && always && !id->special);
+                        if (n->oper == lk::expr_t::ASSIGN || n->oper == lk::expr_t::PLUSEQ)
+                            u.values.push_back(std::make_pair(id->name, n->right));
+                    } else
+                        scan_target(n->left, always, u);
+                    break;
+                case lk::expr_t::INCR:
+                case lk::expr_t::DECR:
+                    // a variable incremented stays a number
+                    if (lk::iden_t *id = dynamic_cast<lk::iden_t *>(n->left))
+                        note_use(u, id->name, false);
+                    else
+                        scan_target(n->left, always, u);
+                    break;
+                case lk::expr_t::LOGIOR:
+                case lk::expr_t::LOGIAND:
+                case lk::expr_t::SWITCH:
+                    scan_scope(n->left, always, u);
+                    scan_scope(n->right, false, u);
+                    break;
+                default:
+                    scan_scope(n->left, always, u);
+                    scan_scope(n->right, always, u);
+                    break;
+            }
+        } else if (lk::iden_t *n = dynamic_cast<lk::iden_t *>(root)) {
+            note_use(u, n->name, false);
+        } else if (lk::ctlstmt_t *n = dynamic_cast<lk::ctlstmt_t *>(root)) {
+            scan_scope(n->rexpr, always, u);
+        }
+    }
+
+/// true for a signature such as "(real:x):real" that returns a number
+    static bool number_sig(const lk_string &sig) {
+        size_t p = sig.rfind("):");
+        if (p == lk_string::npos)
+            return false;
+
+        lk_string ret = sig.substr(p + 2);
+        return ret == "real" || ret == "integer" || ret == "boolean";
+    }
+
+/// a variable holds a number if its first use is an assignment that always runs, every value assigned
+/// to it is a number, and nothing else can change it: it is not an argument of the function, not global,
+/// never passed by reference and never used as an array or table.  the values may be other such variables,
+/// so variables are dropped until all the remaining ones are consistent
+    void codegen::infer_scope(lk::node_t *body, lk::list_t *params) {
+        scope_uses u;
+        scan_scope(body, true, u);
+
+        if (params) {
+            for (size_t i = 0; i < params->items.size(); i++)
+                if (iden_t *id = dynamic_cast<iden_t *>(params->items[i]))
+                    u.changed[id->name] = true;
+        }
+
+        m_numeric.push_back(NameSet());
+        NameSet &numeric = m_numeric.back();
+        for (name_set::iterator it = u.first.begin(); it != u.first.end(); ++it)
+            if (it->second && u.changed.find(it->first) == u.changed.end()
+                && m_escaped.find(it->first) == m_escaped.end())
+                numeric[it->first] = true;
+
+        bool dropped = true;
+        while (dropped) {
+            dropped = false;
+            for (size_t i = 0; i < u.values.size(); i++) {
+                if (numeric.find(u.values[i].first) != numeric.end() && !is_numeric(u.values[i].second)) {
+                    numeric.erase(u.values[i].first);
+                    dropped = true;
+                }
+            }
+        }
+    }
+
+/// true if the value of an expression is proven to be a number in the current scope
+    bool codegen::is_numeric(lk::node_t *root) {
+        if (!root || m_numeric.empty())
+            return false;
+
+        if (dynamic_cast<constant_t *>(root))
+            return true;
+
+        if (iden_t *n = dynamic_cast<iden_t *>(root))
+            return !n->special && m_numeric.back().find(n->name) != m_numeric.back().end();
+
+        if (cond_t *n = dynamic_cast<cond_t *>(root))
+            return n->ternary && is_numeric(n->on_true) && is_numeric(n->on_false);
+
+        expr_t *n = dynamic_cast<expr_t *>(root);
+        if (!n)
+            return false;
+
+        switch (n->oper) {
+            // these produce a number or fail
+            case expr_t::MINUS: case expr_t::MULT: case expr_t::DIV: case expr_t::EXP:
+            case expr_t::NEG: case expr_t::NOT: case expr_t::INCR: case expr_t::DECR:
+            case expr_t::LT: case expr_t::LE: case expr_t::GT: case expr_t::GE: case expr_t::EQ: case expr_t::NE:
+            case expr_t::SIZEOF: case expr_t::MINUSEQ: case expr_t::MULTEQ: case expr_t::DIVEQ:
+                return true;
+            case expr_t::PLUS:
+            case expr_t::PLUSEQ:
+                return is_numeric(n->left) && is_numeric(n->right);
+            case expr_t::ASSIGN:
+                return is_numeric(n->right);
+            case expr_t::LOGIOR:
+            case expr_t::LOGIAND:
+                // the left operand is the value if it decides the result
+                return is_numeric(n->left);
+            case expr_t::CALL:
+                if (iden_t *f = dynamic_cast<iden_t *>(n->left))
+                    return !f->special && returns_number(f->name);
+                return false;
+            default:
+                return false;
+        }
+    }
+
+/// true if the function registered under name is documented to return a number in all of its signatures
+    bool codegen::returns_number(const lk_string &name) {
+        NameSet::iterator it = m_returnsNumber.find(name);
+        if (it != m_returnsNumber.end())
+            return it->second;
+
+        doc_t d;
+        fcallinfo_t *f = m_inferEnv ? m_inferEnv->lookup_func(name) : 0;
+        bool number = f && doc_t::info(f, d) && number_sig(d.sig1)
+                      && (!d.has_2 || number_sig(d.sig2)) && (!d.has_3 || number_sig(d.sig3));
+
+        m_returnsNumber[name] = number;
+        return number;
+    }
+
+    void codegen::emit_binary(lk::expr_t *n, Opcode op) {
+        emit(n->srcpos(), is_numeric(n->left) && is_numeric(n->right) ? number_op(op) : op);
     }
 
 
 /// transfers stack instructions & variable lists to bytecode
-    size_t codegen::get(bytecode &bc) {
+    size_t codegen::get(bytecode &bc, bool optimize) {
         if (m_asm.size() == 0) return 0;
 
         bc.program.resize(m_asm.size(), 0);
-        bc.debuginfo.resize(m_asm.size(), srcpos_t());
+        bc.debuginfo.clear();
 
         for (size_t i = 0; i < m_asm.size(); i++) {
             instr &ip = m_asm[i];
             if (ip.label) m_asm[i].arg = m_labelAddr[*ip.label];
             bc.program[i] = (((unsigned int) ip.op) & 0x000000FF) | (((unsigned int) ip.arg) << 8);
-            bc.debuginfo[i] = m_asm[i].pos;
+            bc.debuginfo.push_back(m_asm[i].pos);
         }
 
         bc.constants = m_constData;
         bc.identifiers = m_idList;
 
+        if (optimize)
+            peephole(bc);
+
+        verify(bc);
+
         return m_asm.size();
     }
 
+    bool codegen::write(const lk_string &file, unsigned long long source_hash, bool optimize) {
+        bytecode bc;
+        if (get(bc, optimize) == 0)
+            return error("no code generated");
+
+        lk_string err;
+        if (!write_bytecode(bc, source_hash, file, &err))
+            return error(err);
+
+        return true;
+    }
+
 /// generates assembly code
     void codegen::textout(lk_string &assembly, lk_string &bytecode) {
         char buf[128];
@@ -118,11 +431,20 @@ namespace lk {
                     } else if (ip.op == SET || ip.op == GET || ip.op == RREF
                                || ip.op == LREF || ip.op == LCREF || ip.op == LGREF || ip.op == ARG) {
                         assembly += m_idList[ip.arg];
+                    } else if (ip.op == RSREF || ip.op == LSREF) {
+                        sprintf(buf, " [%u]", slot_index(ip.arg));
+                        assembly += m_idList[slot_identifier(ip.arg)] + buf;
                     } else if (ip.op == TCALL || ip.op == CALL || ip.op == VEC || ip.op == HASH || ip.op == SWI) {
                         sprintf(buf, "(%d)", ip.arg);
                         assembly += buf;
                     }
 
+                    if (ip.number) {
+                        if (assembly[assembly.size() - 1] != ' ')
+                            assembly += " ";
+                        assembly += ":number";
+                    }
+
                     assembly += '\n';
 
                     unsigned int bc = (((unsigned int) ip.op) & 0x000000FF) | (((unsigned int) ip.arg) << 8);
@@ -145,35 +467,96 @@ namespace lk {
     bool codegen::generate(lk::node_t *root) {
         m_idList.clear();
         m_constData.clear();
+        m_idIndex.clear();
+        m_constIndex.clear();
         m_asm.clear();
         m_labelAddr.clear();
         m_labelCounter = 0;
         m_breakAddr.clear();
         m_continueAddr.clear();
+        m_funcRanges.clear();
+        m_numeric.clear();
+        m_escaped.clear();
+
+        if (m_infer) {
+            collect_escaped(root, m_escaped);
+            infer_scope(root, 0);
+        }
 
         return pfgen(root, F_NONE);
     }
 
 /// adds id to m_idList if not already added, return index of d
     int codegen::place_identifier(const lk_string &id) {
-        for (size_t i = 0; i < m_idList.size(); i++)
-            if (m_idList[i] == id)
-                return (int) i;
+        IdMap::iterator it = m_idIndex.find(id);
+        if (it != m_idIndex.end())
+            return it->second;
 
         m_idList.push_back(id);
+        m_idIndex[id] = (int) m_idList.size() - 1;
         return m_idList.size() - 1;
     }
 
+    static void hash_combine(size_t &h, size_t v) {
+        h ^= v + 0x9e3779b9 + (h << 6) + (h >> 2);
+    }
+
+    static size_t number_hash(double d) {
+        if (vardata_t::is_null_num(d)) return vardata_t::NULLVAL;
+        if (d == 0.0) d = 0.0; // -0 equals 0
+        return std::hash<double>()(d);
+    }
+
+/// hash of a constant consistent with vardata_t::equals: arrays hash the same packed or not,
+/// and tables combine their items independent of order
+    static size_t const_hash(const vardata_t &d) {
+        switch (d.type()) {
+            case vardata_t::NUMBER:
+                return number_hash(d.num());
+
+            case vardata_t::STRING:
+                return lk_string_hash()(d.str());
+
+            case vardata_t::VECTOR: {
+                size_t h = vardata_t::VECTOR;
+                if (const std::vector<double> *nums = d.cnumvec()) {
+                    for (size_t i = 0; i < nums->size(); i++)
+                        hash_combine(h, number_hash((*nums)[i]));
+                } else {
+                    const std::vector<vardata_t> *v = d.cvec();
+                    for (size_t i = 0; i < v->size(); i++)
+                        hash_combine(h, (*v)[i].type() == vardata_t::NUMBER ? number_hash((*v)[i].num())
+                                                                             : const_hash((*v)[i]));
+                }
+                return h;
+            }
+
+            case vardata_t::HASH: {
+                size_t h = 0;
+                const varhash_t *t = d.chash();
+                for (varhash_t::const_iterator it = t->begin(); it != t->end(); ++it) {
+                    size_t item = lk_string_hash()(it->first);
+                    hash_combine(item, const_hash(it->second));
+                    h += item;
+                }
+                return h ^ vardata_t::HASH;
+            }
+
+            default:
+                return d.type();
+        }
+    }
+
 /// adds d to m_constData if not already added, return index of d
     int codegen::place_const(vardata_t &d) {
-        if (d.type() == vardata_t::HASH && d.hash()->size() == 2)
-            printf("stop here");
-
-        for (size_t i = 0; i < m_constData.size(); i++)
-            if (m_constData[i].equals(d))
-                return (int) i;
+        size_t h = const_hash(d);
+        std::pair<ConstMap::iterator, ConstMap::iterator> range = m_constIndex.equal_range(h);
+        for (ConstMap::iterator it = range.first; it != range.second; ++it)
+            if (m_constData[it->second].equals(d))
+                return it->second;
 
         m_constData.push_back(d);
+        m_constIndex.insert(std::make_pair(h, (int) m_constData.size() - 1));
         return (int) m_constData.size() - 1;
     }
 
@@ -190,6 +573,37 @@ namespace lk {
         return place_const(x);
     }
 
+/// identifiers declared as arguments or assigned within a function body are its locals.
+/// references to them are given a frame slot so the vm can skip the hashed name lookup
+/// once the variable exists.  bodies of nested functions are separate scopes and skipped.
+    void codegen::resolve_slots(size_t begin, size_t end, size_t first_inner) {
+        std::vector<bool> skip(end - begin, false);
+        for (size_t i = first_inner; i < m_funcRanges.size(); i++)
+            for (size_t k = m_funcRanges[i].first; k < m_funcRanges[i].second; k++)
+                skip[k - begin] = true;
+
+        // slot number assigned to each local, indexed by identifier
+        std::vector<int> slots(m_idList.size(), -1);
+        int nslots = 0;
+        for (size_t i = begin; i < end; i++) {
+            instr &in = m_asm[i];
+            if (!skip[i - begin] && (in.op == ARG || in.op == LREF || in.op == LCREF) && slots[in.arg] < 0)
+                slots[in.arg] = nslots++;
+        }
+
+        for (size_t i = begin; i < end; i++) {
+            instr &in = m_asm[i];
+            if (skip[i - begin] || (in.op != RREF && in.op != LREF))
+                continue;
+
+            int slot = slots[in.arg];
+            if (slot >= 0 && slot <= (int) SLOT_MAX && in.arg <= (int) SLOT_IDENTIFIER_MAX) {
+                in.arg = (int) slot_arg((unsigned int) slot, (unsigned int) in.arg);
+                in.op = (in.op == RREF) ? RSREF : LSREF;
+            }
+        }
+    }
+
     lk_string codegen::new_label() {
         char buf[128];
         sprintf(buf, "L%d", m_labelCounter++);
@@ -379,52 +793,52 @@ namespace lk {
                 case expr_t::PLUS:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), ADD);
+                    emit_binary(n4, ADD);
                     break;
                 case expr_t::MINUS:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), SUB);
+                    emit_binary(n4, SUB);
                     break;
                 case expr_t::MULT:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), MUL);
+                    emit_binary(n4, MUL);
                     break;
                 case expr_t::DIV:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), DIV);
+                    emit_binary(n4, DIV);
                     break;
                 case expr_t::LT:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), LT);
+                    emit_binary(n4, LT);
                     break;
                 case expr_t::GT:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), GT);
+                    emit_binary(n4, GT);
                     break;
                 case expr_t::LE:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), LE);
+                    emit_binary(n4, LE);
                     break;
                 case expr_t::GE:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), GE);
+                    emit_binary(n4, GE);
                     break;
                 case expr_t::NE:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), NE);
+                    emit_binary(n4, NE);
                     break;
                 case expr_t::EQ:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, flags);
-                    emit(n4->srcpos(), EQ);
+                    emit_binary(n4, EQ);
                     break;
                 case expr_t::INCR:
                     pfgen(n4->left, flags | F_MUTABLE);
@@ -468,17 +882,19 @@ namespace lk {
                     emit(n4->srcpos(), EXP);
                     break;
                 case expr_t::INDEX:
-                    pfgen(n4->left, flags);
+                    pfgen(n4->left, flags & (F_MUTABLE | F_REFERENCE));
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), IDX, flags & F_MUTABLE);
+                    if (flags & F_MUTABLE) emit(n4->srcpos(), LIDX);
+                    else emit(n4->srcpos(), IDX, (flags & F_REFERENCE) ? 1 : 0);
                     break;
                 case expr_t::HASH:
                     pfgen(n4->left, flags);
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), KEY, flags & F_MUTABLE);
+                    if (flags & F_MUTABLE) emit(n4->srcpos(), LKEY);
+                    else emit(n4->srcpos(), KEY, (flags & F_REFERENCE) ? 1 : 0);
                     break;
                 case expr_t::MINUSAT:
-                    pfgen(n4->left, F_NONE);
+                    pfgen(n4->left, F_REFERENCE);
                     pfgen(n4->right, flags);
                     emit(n4->srcpos(), MAT);
                     break;
@@ -488,32 +904,24 @@ namespace lk {
                     emit(n4->srcpos(), WAT);
                     break;
                 case expr_t::PLUSEQ:
-                    pfgen(n4->left, F_NONE);
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), ADD);
                     pfgen(n4->left, F_MUTABLE);
-                    emit(n4->srcpos(), WR);
+                    emit(n4->srcpos(), ADDEQ);
                     break;
                 case expr_t::MINUSEQ:
-                    pfgen(n4->left, F_NONE);
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), SUB);
                     pfgen(n4->left, F_MUTABLE);
-                    emit(n4->srcpos(), WR);
+                    emit(n4->srcpos(), SUBEQ);
                     break;
                 case expr_t::MULTEQ:
-                    pfgen(n4->left, F_NONE);
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), MUL);
                     pfgen(n4->left, F_MUTABLE);
-                    emit(n4->srcpos(), WR);
+                    emit(n4->srcpos(), MULEQ);
                     break;
                 case expr_t::DIVEQ:
-                    pfgen(n4->left, F_NONE);
                     pfgen(n4->right, F_NONE);
-                    emit(n4->srcpos(), DIV);
                     pfgen(n4->left, F_MUTABLE);
-                    emit(n4->srcpos(), WR);
+                    emit(n4->srcpos(), DIVEQ);
                     break;
                 case expr_t::ASSIGN: {
                     if (!pfgen(n4->right, flags)) return false;
@@ -543,13 +951,15 @@ namespace lk {
                         for (std::vector<node_t *>::iterator it = argvals->items.begin();
                              it != argvals->items.end();
                              ++it) {
-                            pfgen(*it, F_NONE);
+                            expr_t *argexpr = dynamic_cast<expr_t *>(*it);
+                            pfgen(*it, (argexpr && (argexpr->oper == expr_t::INDEX || argexpr->oper == expr_t::HASH))
+                                       ? F_REFERENCE : F_NONE);
                             nargs++;
                         }
                     }
                     expr_t *lexpr = dynamic_cast<expr_t *>(n4->left);
                     if (n4->oper == expr_t::THISCALL && 0 != lexpr) {
-                        pfgen(lexpr->left, F_NONE);
+                        pfgen(lexpr->left, F_REFERENCE);
                         emit(n4->srcpos(), DUP);
                         pfgen(lexpr->right, F_NONE);
                         emit(n4->srcpos(), KEY);
@@ -651,6 +1061,12 @@ namespace lk {
                     emit(n4->srcpos(), J, Le);
                     place_label(Lf);
 
+                    size_t body_begin = m_asm.size();
+                    size_t first_inner = m_funcRanges.size();
+
+                    if (references_args(n4->right))
+                        emit(n4->srcpos(), ARGS);
+
                     list_t *p = dynamic_cast<list_t *>(n4->left);
                     if (p) {
                         for (size_t i = 0; i < p->items.size(); i++) {
@@ -659,17 +1075,30 @@ namespace lk {
                         }
                     }
 
+                    if (m_infer)
+                        infer_scope(n4->right, p);
+
                     pfgen(n4->right, F_NONE);
 
+                    if (m_infer)
+                        m_numeric.pop_back();
+
                     // if the last statement in the function block,
                     // is not a return issue an implicit return statement
                     if (m_asm.back().op != RET) {
                         // for implicit return at end of function, use last code line number of block
                         srcpos_t posend = n4->srcpos();
                         posend.stmt = posend.stmt_end;
-                        emit(posend, RET, 0);
+
+                        // a body that is a single expression leaves its value, which is returned
+                        cond_t *cond = dynamic_cast<cond_t *>(n4->right);
+                        bool has_value = dynamic_cast<expr_t *>(n4->right) != 0 || (cond && cond->ternary);
+                        emit(posend, RET, has_value ? 1 : 0);
                     }
 
+                    resolve_slots(body_begin, m_asm.size(), first_inner);
+                    m_funcRanges.push_back(std::make_pair(body_begin, m_asm.size()));
+
                     place_label(Le);
                     emit(n4->srcpos(), FREF, Lf);
                 }
@@ -680,9 +1109,17 @@ namespace lk {
             }
         } else if (ctlstmt_t *n5 = dynamic_cast<ctlstmt_t *>(root)) {
             switch (n5->ictl) {
-                case ctlstmt_t::RETURN:
+                case ctlstmt_t::RETURN: {
                     pfgen(n5->rexpr, F_NONE);
+
+                    // a call in return position reuses the frame of the returning function.  the
+                    // return stays in the program for when the vm makes an ordinary call instead
+                    expr_t *call = dynamic_cast<expr_t *>(n5->rexpr);
+                    if (call && call->oper == expr_t::CALL && m_asm.back().op == CALL)
+                        m_asm.back().op = TAILCALL;
+
                     emit(n5->srcpos(), RET, n5->rexpr ? 1 : 0);
+                }
                     break;
 
                 case ctlstmt_t::BREAK:
@@ -720,6 +1157,7 @@ namespace lk {
                 }
 
                 emit(n6->srcpos(), op, place_identifier(n6->name));
+                m_asm.back().number = is_numeric(n6);
             }
         } else if (null_t *n7 = dynamic_cast<null_t *>(root)) {
             emit(n7->srcpos(), NUL);
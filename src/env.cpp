@@ -27,6 +27,10 @@
 #include <cstdlib>
 #include <limits>
 #include <cmath>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <stdint.h>
 
 #include <lk/env.h>
 #include <lk/eval.h>
@@ -54,6 +58,160 @@ static void *dll_sym(void *handle, const char *name) { return dlsym(handle, name
 
 #endif
 
+/// payload of a STRING, VECTOR or HASH value, shared by all copies until one of them is modified
+template<typename T>
+struct shared_t {
+    shared_t() : refs(1), unshareable(false) {}
+
+    explicit shared_t(const T &d) : refs(1), unshareable(false), data(d) {}
+
+    std::atomic<size_t> refs;
+    bool unshareable; ///< pointers into data have been handed out, copies get their own
+    T data;
+};
+
+/// VECTOR payload, holding the elements as packed numbers until something else is stored
+struct shared_vec_t {
+    shared_vec_t() : refs(1), unshareable(false), packed(true) {}
+
+    shared_vec_t(const shared_vec_t &cp)
+            : refs(1), unshareable(false), packed(cp.packed), nums(cp.nums), data(cp.data) {}
+
+    std::atomic<size_t> refs;
+    bool unshareable; ///< pointers into data have been handed out, copies get their own
+    bool packed;
+    std::vector<double> nums;
+    std::vector<lk::vardata_t> data;
+};
+
+/// STRING payload.  strings up to INTERN_MAX characters are interned: there is one immutable payload
+/// per distinct value, found through the global intern table, so that two interned strings are equal
+/// exactly when their payloads are the same
+struct shared_str_t {
+    explicit shared_str_t(const lk_string &d) : refs(1), data(d), hash(0), interned(false) {}
+
+    std::atomic<size_t> refs;
+    lk_string data;
+    size_t hash; ///< of data, kept for interned strings
+    bool interned;
+};
+
+typedef shared_t<lk::varhash_t> shared_hash_t;
+
+static const size_t INTERN_MAX = 64;
+
+/// interned strings by hash, split into shards that are locked independently so that threads
+/// creating and releasing short strings rarely wait on each other.  the last reference to a string
+/// is only dropped with its shard locked, so a lookup never revives a string that is being deleted
+struct intern_shard {
+    std::mutex lock;
+    std::unordered_multimap<size_t, shared_str_t *> strings;
+};
+
+static const size_t INTERN_SHARDS = 64; // a power of two
+
+static intern_shard &interns(size_t hash) {
+    static intern_shard *t = new intern_shard[INTERN_SHARDS]; // never destroyed, values may outlive static destructors
+    return t[(hash ^ (hash >> 17)) & (INTERN_SHARDS - 1)];
+}
+
+static shared_str_t *intern(const lk_string &s) {
+    size_t h = lk_string_hash()(s);
+    intern_shard &t = interns(h);
+    std::lock_guard<std::mutex> guard(t.lock);
+
+    typedef std::unordered_multimap<size_t, shared_str_t *>::iterator iter;
+    std::pair<iter, iter> range = t.strings.equal_range(h);
+    for (iter it = range.first; it != range.second; ++it) {
+        if (it->second->data == s) {
+            it->second->refs++;
+            return it->second;
+        }
+    }
+
+    shared_str_t *p = new shared_str_t(s);
+    p->hash = h;
+    p->interned = true;
+    t.strings.insert(std::make_pair(h, p));
+    return p;
+}
+
+static shared_str_t *new_str(const lk_string &s) {
+    return s.length() <= INTERN_MAX ? intern(s) : new shared_str_t(s);
+}
+
+static void release_str(shared_str_t *s) {
+    if (!s->interned) {
+        if (s->refs.fetch_sub(1) == 1) delete s;
+        return;
+    }
+
+    size_t n = s->refs.load();
+    while (n > 1)
+        if (s->refs.compare_exchange_weak(n, n - 1))
+            return;
+
+    intern_shard &t = interns(s->hash);
+    std::lock_guard<std::mutex> guard(t.lock);
+    if (s->refs.fetch_sub(1) != 1)
+        return;
+
+    typedef std::unordered_multimap<size_t, shared_str_t *>::iterator iter;
+    std::pair<iter, iter> range = t.strings.equal_range(s->hash);
+    for (iter it = range.first; it != range.second; ++it) {
+        if (it->second == s) {
+            t.strings.erase(it);
+            break;
+        }
+    }
+    delete s;
+}
+
+static inline shared_str_t *str_payload(void *p) { return reinterpret_cast<shared_str_t *>(p); }
+
+static inline lk_string &str_data(void *p) { return reinterpret_cast<shared_str_t *>(p)->data; }
+
+static inline shared_vec_t *vec_payload(void *p) { return reinterpret_cast<shared_vec_t *>(p); }
+
+/// generic elements of an array, only valid once it has been unpacked
+static inline std::vector<lk::vardata_t> &vec_data(void *p) { return reinterpret_cast<shared_vec_t *>(p)->data; }
+
+/// a signalling NaN that arithmetic never produces marks null elements of packed arrays
+static const uint64_t NULL_NUM_BITS = 0x7FF4000000000BADULL;
+
+static inline double null_num() {
+    double x;
+    memcpy(&x, &NULL_NUM_BITS, sizeof(x));
+    return x;
+}
+
+static inline double packed_num(double d) {
+    return lk::vardata_t::is_null_num(d) ? std::numeric_limits<double>::quiet_NaN() : d;
+}
+
+static inline void num_element(double x, lk::vardata_t &out) {
+    if (lk::vardata_t::is_null_num(x)) out.nullify();
+    else out.assign(x);
+}
+
+static inline lk::varhash_t &hash_data(void *p) { return reinterpret_cast<shared_hash_t *>(p)->data; }
+
+static void release_hash(shared_hash_t *h) {
+    if (h->refs.fetch_sub(1) == 1) {
+        delete h;
+    }
+}
+
+#ifdef LK_NANBOX
+lk::vardata_t::vardata_t() {
+    m_bits = box(NULLVAL);
+}
+
+lk::vardata_t::vardata_t(const vardata_t &cp) {
+    m_bits = box(NULLVAL);
+    copy(cp);
+}
+#else
 lk::vardata_t::vardata_t() {
     m_type = 0;
     set_type(NULLVAL);
@@ -62,18 +220,60 @@ lk::vardata_t::vardata_t() {
 lk::vardata_t::vardata_t(const vardata_t &cp) {
     m_type = 0;
     set_type(NULLVAL);
-    copy(const_cast<vardata_t &>(cp));
+    copy(cp);
 }
+#endif
 
 lk::vardata_t::~vardata_t() {
     nullify();
 }
 
 /* private member functions */
+#ifdef LK_NANBOX
+void lk::vardata_t::set_type(unsigned char ty) {
+    m_bits = box(ty) | flagbits();
+}
+
+double lk::vardata_t::boxed_dval() const {
+    const double *v = reinterpret_cast<const double *>(ptr());
+    return v ? *v : std::numeric_limits<double>::quiet_NaN();
+}
+
+/// a value boxed as anything but a number, or with flags, moves to a box of its own
+void lk::vardata_t::set_boxed_dval(double d) {
+    double *v = (type() == NUMBER) ? reinterpret_cast<double *>(ptr()) : 0;
+    uint64_t flags = flagbits();
+
+    if (flags == 0 && !std::isnan(d)) {
+        delete v;
+        memcpy(&m_bits, &d, sizeof(d));
+        return;
+    }
+
+    if (std::isnan(d)) {
+        delete v;
+        v = 0;
+    } else {
+        if (!v) v = new double;
+        *v = d;
+    }
+
+    m_bits = box(NUMBER) | ((uint64_t) (uintptr_t) v & PTRMASK) | flags;
+}
+
+/// a number about to carry a flag moves into a box first
+void lk::vardata_t::set_flag(unsigned char flag) {
+    if (!boxed())
+        m_bits = box(NUMBER) | ((uint64_t) (uintptr_t) new double(dval()) & PTRMASK);
+
+    m_bits |= (uint64_t) 0x01 << (flag - 1);
+}
+#else
 void lk::vardata_t::set_type(unsigned char ty) {
     m_type &= FLAGMASK; // clear all type info
     m_type |= (ty & TYPEMASK); // set lower 4 bits to type
 }
+#endif
 
 /// checks if value has been assigned and is constant
 void lk::vardata_t::assert_modify() {
@@ -82,14 +282,103 @@ void lk::vardata_t::assert_modify() {
         throw error_t(lk_tr("cannot modify a constant value"));
     }
 
-    set_flag(ASSIGNED);
+    // only a constant needs to remember that it has been assigned
+    if (flagval(CONSTVAL))
+        set_flag(ASSIGNED);
+}
+
+/// converts a packed array to generic elements, leaving other values sharing the payload packed
+void lk::vardata_t::unpack() const {
+    if (type() != VECTOR) return;
+
+    shared_vec_t *v = vec_payload(ptr());
+    if (!v->packed) return;
+
+    shared_vec_t *g = v;
+    if (v->refs.load() > 1)
+        g = new shared_vec_t;
+
+    g->data.resize(v->nums.size());
+    for (size_t i = 0; i < v->nums.size(); i++)
+        num_element(v->nums[i], g->data[i]);
+
+    g->packed = false;
+    if (g == v)
+        std::vector<double>().swap(v->nums);
+    else {
+        const_cast<vardata_t *>(this)->set_ptr(VECTOR, g);
+        if (v->refs.fetch_sub(1) == 1) delete v;
+    }
+}
+
+bool lk::vardata_t::is_null_num(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    return bits == NULL_NUM_BITS;
+}
+
+/// gives this value its own copy of a shared payload before it is modified
+void lk::vardata_t::unshare() const {
+    vardata_t *self = const_cast<vardata_t *>(this);
+    switch (type()) {
+        case STRING: {
+            // interned strings are immutable and stay shared
+            shared_str_t *s = str_payload(ptr());
+            if (!s->interned && s->refs.load() > 1) {
+                self->set_ptr(STRING, new shared_str_t(s->data));
+                release_str(s);
+            }
+        }
+            break;
+        case VECTOR: {
+            // element copies share their own payloads, so this is one level deep
+            shared_vec_t *v = vec_payload(ptr());
+            if (v->refs.load() > 1) {
+                self->set_ptr(VECTOR, new shared_vec_t(*v));
+                if (v->refs.fetch_sub(1) == 1) delete v;
+            }
+        }
+            break;
+        case HASH: {
+            shared_hash_t *h = reinterpret_cast<shared_hash_t *>(ptr());
+            if (h->refs.load() > 1) {
+                self->set_ptr(HASH, new shared_hash_t(h->data));
+                release_hash(h);
+            }
+        }
+            break;
+    }
+}
+
+/// the pointer handed out may be written through after this value is copied, e.g.  an element
+/// passed by reference to a function that copies the array, so the payload is never shared again
+void lk::vardata_t::own() const {
+    unshare();
+    if (type() == VECTOR) {
+        shared_vec_t *v = vec_payload(ptr());
+        if (!v->unshareable) v->unshareable = true;
+    } else if (type() == HASH) {
+        shared_hash_t *h = reinterpret_cast<shared_hash_t *>(ptr());
+        if (!h->unshareable) h->unshareable = true;
+    }
+}
+
+std::vector<lk::vardata_t> &lk::vardata_t::elements() const {
+    unshare();
+    unpack();
+    return vec_data(ptr());
+}
+
+lk::varhash_t &lk::vardata_t::entries() const {
+    unshare();
+    return hash_data(ptr());
 }
 
 /* public interface */
 
 bool lk::vardata_t::as_boolean() const {
     if (type() == NUMBER
-        && m_u.v == 0.0)
+        && dval() == 0.0)
         return false;
 
     if (type() == STRING) {
@@ -124,18 +413,32 @@ lk_string lk::vardata_t::as_string() const {
         case REFERENCE:
             return deref().as_string();
         case NUMBER: {
-            if (((double) ((int) m_u.v)) == m_u.v)
-                sprintf(buf, "%d", (int) m_u.v);
+            double v = dval();
+            if (((double) ((int) v)) == v)
+                sprintf(buf, "%d", (int) v);
             else
-                sprintf(buf, "%lf", m_u.v);
+                sprintf(buf, "%lf", v);
             return lk_string(buf);
         }
         case STRING:
-            return *reinterpret_cast<lk_string *>(m_u.p);
+            return str_data(ptr());
         case VECTOR: {
-            std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
-
             lk_string s("[ ");
+            if (const std::vector<double> *nv = cnumvec()) {
+                vardata_t x;
+                for (size_t i = 0; i < nv->size(); i++) {
+                    num_element((*nv)[i], x);
+                    s += x.as_string();
+                    if (i + 1 < nv->size())
+                        s += ", ";
+                }
+
+                s += " ]";
+                return s;
+            }
+
+            const std::vector<vardata_t> &v = vec_data(ptr());
+
             for (size_t i = 0; i < v.size(); i++) {
                 s += v[i].as_string();
                 if (v.size() > 1 && i < v.size() - 1)
@@ -147,13 +450,13 @@ lk_string lk::vardata_t::as_string() const {
             return s;
         }
         case HASH: {
-            varhash_t &h = *reinterpret_cast<varhash_t *>(m_u.p);
+            const varhash_t &h = hash_data(ptr());
             lk_string s("{ ");
 
-            for (varhash_t::iterator it = h.begin(); it != h.end(); ++it) {
+            for (varhash_t::const_iterator it = h.begin(); it != h.end(); ++it) {
                 s += it->first;
                 s += "=";
-                s += it->second->as_string();
+                s += it->second.as_string();
                 s += " ";
             }
 
@@ -194,7 +497,7 @@ double lk::vardata_t::as_number() const {
         case NULLVAL:
             return 0;
         case NUMBER:
-            return m_u.v;
+            return dval();
         case STRING:
             return my_atof((const char *) str().c_str());
         case REFERENCE:
@@ -210,22 +513,63 @@ void lk::vardata_t::deep_localize() {
             copy(deref());
             break;
         case VECTOR: {
-            for (size_t i = 0; i < length(); i++)
-                index(i)->deep_localize();
+            // packed arrays hold only numbers, nothing to localize
+            if (cnumvec()) break;
+            std::vector<vardata_t> &v = elements();
+            for (size_t i = 0; i < v.size(); i++)
+                v[i].deep_localize();
         }
             break;
         case HASH: {
-            varhash_t &hh = *hash();
+            varhash_t &hh = entries();
             for (varhash_t::iterator it = hh.begin();
                  it != hh.end();
                  ++it)
-                it->second->deep_localize();
+                it->second.deep_localize();
         }
             break;
     }
 }
 
-bool lk::vardata_t::copy(vardata_t &rhs) {
+// whether an array or table holds a packed array at any depth
+static bool has_packed_elements(const lk::vardata_t &x) {
+    if (x.type() == lk::vardata_t::VECTOR && !x.cnumvec()) {
+        const std::vector<lk::vardata_t> &v = *x.cvec();
+        for (size_t i = 0; i < v.size(); i++)
+            if (v[i].cnumvec() || has_packed_elements(v[i]))
+                return true;
+    } else if (x.type() == lk::vardata_t::HASH) {
+        const lk::varhash_t &h = *x.chash();
+        for (lk::varhash_t::const_iterator it = h.begin(); it != h.end(); ++it)
+            if (it->second.cnumvec() || has_packed_elements(it->second))
+                return true;
+    }
+    return false;
+}
+
+/// packed arrays unpack themselves in place when first read as generic elements, which is not safe
+/// on a payload other threads are reading too.  a copy of this value unpacks into a payload of its
+/// own, but the arrays nested in it are shared by all copies, so they are unpacked here first
+void lk::vardata_t::unpack_nested() {
+    if (!has_packed_elements(*this))
+        return;
+
+    if (type() == VECTOR) {
+        std::vector<vardata_t> &v = elements();
+        for (size_t i = 0; i < v.size(); i++) {
+            if (v[i].cnumvec()) v[i].cvec();
+            else v[i].unpack_nested();
+        }
+    } else {
+        varhash_t &h = entries();
+        for (varhash_t::iterator it = h.begin(); it != h.end(); ++it) {
+            if (it->second.cnumvec()) it->second.cvec();
+            else it->second.unpack_nested();
+        }
+    }
+}
+
+bool lk::vardata_t::copy(const vardata_t &rhs) {
     switch (rhs.type()) {
         case NULLVAL:
             assert_modify();
@@ -233,38 +577,40 @@ bool lk::vardata_t::copy(vardata_t &rhs) {
             return true;
         case REFERENCE:
             assert_modify();
-            nullify();
-            set_type(REFERENCE);
-            if (rhs.m_u.p == this)
+            if (rhs.ptr() == this)
                 throw error_t(lk_tr("internal error: copying self-referential reference"));
-            m_u.p = rhs.m_u.p;
+            nullify();
+            set_ptr(REFERENCE, rhs.ptr());
             return true;
         case NUMBER:
-            assign(rhs.m_u.v);
+            assign(rhs.dval());
             return true;
         case STRING:
-            assign(rhs.str());
-            return true;
-        case VECTOR: {
-            resize(rhs.length());
-            std::vector<vardata_t> &v = *reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
-            std::vector<vardata_t> *rv = rhs.vec();
-            for (size_t i = 0; i < v.size(); i++)
-                v[i].copy((*rv)[i]);
-        }
-            return true;
+        case VECTOR:
         case HASH: {
-            empty_hash();
-            varhash_t &h = (*reinterpret_cast<varhash_t *>(m_u.p));
-            varhash_t &rh = (*reinterpret_cast<varhash_t *>(rhs.m_u.p));
-
-            for (varhash_t::iterator it = rh.begin();
-                 it != rh.end();
-                 ++it) {
-                vardata_t *cp = new vardata_t;
-                cp->copy(*it->second);
-                h[(*it).first] = cp;
+            // share the payload, taking the reference before releasing the old
+            // value in case rhs lives inside it, e.g.  x = x[1];  an unshareable
+            // payload is copied instead, see own()
+            assert_modify();
+            void *p = rhs.ptr();
+            unsigned char ty = rhs.type();
+            if (type() == ty && ptr() == p)
+                return true;
+
+            if (ty == STRING)
+                reinterpret_cast<shared_str_t *>(p)->refs++;
+            else if (ty == VECTOR) {
+                shared_vec_t *v = vec_payload(p);
+                if (v->unshareable) p = new shared_vec_t(*v);
+                else v->refs++;
+            } else {
+                shared_hash_t *h = reinterpret_cast<shared_hash_t *>(p);
+                if (h->unshareable) p = new shared_hash_t(h->data);
+                else h->refs++;
             }
+
+            nullify();
+            set_ptr(ty, p);
         }
             return true;
 
@@ -273,8 +619,7 @@ bool lk::vardata_t::copy(vardata_t &rhs) {
         case FUNCTION:
             assert_modify();
             nullify();
-            set_type(rhs.type());
-            m_u.p = rhs.m_u.p;
+            set_ptr(rhs.type(), rhs.ptr());
             return true;
 
         default:
@@ -282,7 +627,59 @@ bool lk::vardata_t::copy(vardata_t &rhs) {
     }
 }
 
-bool lk::vardata_t::equals(vardata_t &rhs) const {
+// whether x is one of the elements of the arrays and tables in v, at any depth
+static bool holds(const lk::vardata_t &v, const lk::vardata_t *x) {
+    if (v.type() == lk::vardata_t::VECTOR && !v.cnumvec()) {
+        const std::vector<lk::vardata_t> &d = *v.cvec();
+        for (size_t i = 0; i < d.size(); i++)
+            if (&d[i] == x || holds(d[i], x))
+                return true;
+    } else if (v.type() == lk::vardata_t::HASH) {
+        const lk::varhash_t &h = *v.chash();
+        for (lk::varhash_t::const_iterator it = h.begin(); it != h.end(); ++it)
+            if (&it->second == x || holds(it->second, x))
+                return true;
+    }
+    return false;
+}
+
+bool lk::vardata_t::store(const vardata_t &rhs) {
+    unsigned char ty = rhs.type();
+    if (ty != VECTOR && ty != HASH)
+        return copy(rhs);
+
+    // the temporary also holds on to rhs in case this value is all that keeps it, e.g.  x = x[1];
+    vardata_t temp(rhs);
+    temp.unshare_path(this);
+    return copy(temp);
+}
+
+void lk::vardata_t::unshare_path(const vardata_t *x) {
+    if (type() == VECTOR && !cnumvec()) {
+        const std::vector<vardata_t> &d = *cvec();
+        for (size_t i = 0; i < d.size(); i++) {
+            bool direct = (&d[i] == x);
+            if (direct || holds(d[i], x)) {
+                vardata_t &e = elements()[i];
+                if (!direct) e.unshare_path(x);
+                return;
+            }
+        }
+    } else if (type() == HASH) {
+        const varhash_t &h = *chash();
+        for (varhash_t::const_iterator it = h.begin(); it != h.end(); ++it) {
+            bool direct = (&it->second == x);
+            if (direct || holds(it->second, x)) {
+                lk_string key(it->first);
+                vardata_t &e = entries().find(key)->second;
+                if (!direct) e.unshare_path(x);
+                return;
+            }
+        }
+    }
+}
+
+bool lk::vardata_t::equals(const vardata_t &rhs) const {
     if (type() != rhs.type()) return false;
 
     switch (type()) {
@@ -290,41 +687,70 @@ bool lk::vardata_t::equals(vardata_t &rhs) const {
             return true;
 
         case NUMBER:
-            return m_u.v == rhs.m_u.v;
+            return dval() == rhs.dval();
 
-        case STRING:
-            return str() == rhs.str();
+        case STRING: {
+            shared_str_t *s1 = str_payload(ptr()), *s2 = str_payload(rhs.ptr());
+            if (s1 == s2) return true;
+            if (s1->interned && s2->interned) return false;
+            return s1->data == s2->data;
+        }
 
         case VECTOR: {
-            size_t len = vec()->size();
-            if (len != rhs.vec()->size())
+            if (ptr() == rhs.ptr())
+                return true;
+
+            size_t len = length();
+            if (len != rhs.length())
                 return false;
-            for (size_t i = 0; i < len; i++)
-                if (!(*vec())[i].equals((*rhs.vec())[i]))
-                    return false;
+
+            const std::vector<double> *n1 = cnumvec(), *n2 = rhs.cnumvec();
+            if (n1 && n2) {
+                for (size_t i = 0; i < len; i++) {
+                    double x1 = (*n1)[i], x2 = (*n2)[i];
+                    if (is_null_num(x1) || is_null_num(x2)) {
+                        if (is_null_num(x1) != is_null_num(x2))
+                            return false;
+                    } else if (x1 != x2)
+                        return false;
+                }
+            } else {
+                vardata_t x1, x2;
+                for (size_t i = 0; i < len; i++) {
+                    const vardata_t *e1 = n1 ? &x1 : &vec_data(ptr())[i];
+                    const vardata_t *e2 = n2 ? &x2 : &vec_data(rhs.ptr())[i];
+                    if (n1) num_element((*n1)[i], x1);
+                    if (n2) num_element((*n2)[i], x2);
+                    if (!e1->equals(*e2))
+                        return false;
+                }
+            }
 
             return true;
         }
             break;
 
         case HASH: {
-            varhash_t *h1 = hash();
-            varhash_t *h2 = rhs.hash();
+            if (ptr() == rhs.ptr())
+                return true;
+
+            const varhash_t *h1 = chash();
+            const varhash_t *h2 = rhs.chash();
 
             // if number of pairs is different, not equal
             if (h1->size() != h2->size())
                 return false;
 
-            for (varhash_t::iterator it = h1->begin();
+            for (varhash_t::const_iterator it = h1->begin();
                  it != h1->end();
                  ++it) {
                 // if second hash doesn't have this key, not equal
-                varhash_t::iterator it2 = h2->find(it->first);
+                varhash_t::const_iterator it2 = h2->find(it->first);
                 if (it2 == h2->end())
                     return false;
 
                 // if the values of this key are different, not equal
-                if (!it->second->equals(*it2->second))
+                if (!it->second.equals(it2->second))
                     return false;
             }
 
@@ -346,14 +772,14 @@ bool lk::vardata_t::equals(vardata_t &rhs) const {
     }
 }
 
-bool lk::vardata_t::lessthan(vardata_t &rhs) const {
+bool lk::vardata_t::lessthan(const vardata_t &rhs) const {
     if (type() != rhs.type()) return false;
 
     switch (type()) {
         case NUMBER:
-            return m_u.v < rhs.m_u.v;
+            return dval() < rhs.dval();
         case STRING:
-            return str() < rhs.str();
+            return str_data(ptr()) < str_data(rhs.ptr());
         default:
             return false;
     }
@@ -382,24 +808,33 @@ const char *lk::vardata_t::typestr() const {
     }
 }
 
-/// deletes value, ie object to which m_u.p points
+/// deletes value, ie object to which the payload pointer points
 void lk::vardata_t::nullify() {
+#ifdef LK_NANBOX
+    // a number stored in place owns nothing
+    if (!boxed()) {
+        m_bits = box(NULLVAL);
+        return;
+    }
+#endif
+
     switch (type()) {
         case STRING:
-            delete reinterpret_cast<lk_string *>(m_u.p);
+            release_str(str_payload(ptr()));
             break;
-        case HASH: {
-            varhash_t *h = reinterpret_cast<varhash_t *>(m_u.p);
-            for (varhash_t::iterator it = h->begin();
-                 it != h->end();
-                 ++it)
-                delete it->second;
-            delete h;
+        case HASH:
+            release_hash(reinterpret_cast<shared_hash_t *>(ptr()));
+            break;
+        case VECTOR: {
+            shared_vec_t *v = vec_payload(ptr());
+            if (v->refs.fetch_sub(1) == 1) delete v;
         }
             break;
-        case VECTOR:
-            delete reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
+#ifdef LK_NANBOX
+        case NUMBER:
+            if (boxed()) delete reinterpret_cast<double *>(ptr());
             break;
+#endif
 
             // note: functions not deleted here because they
             // are pointers into the abstract syntax tree
@@ -411,51 +846,48 @@ void lk::vardata_t::nullify() {
 void lk::vardata_t::assign(double d) {
     assert_modify();
 
-    nullify();
-    set_type(NUMBER);
-    m_u.v = d;
+    // a boxed number keeps its box
+    if (type() != NUMBER) nullify();
+    set_dval(d);
 }
 
 void lk::vardata_t::assign(const char *s) {
-    assert_modify();
-
-    if (type() != STRING) {
-        nullify();
-        set_type(STRING);
-        m_u.p = new lk_string(s);
-    } else {
-        *reinterpret_cast<lk_string *>(m_u.p) = s;
-    }
+    assign(lk_string(s));
 }
 
 /// function for associating an lk_string pointer to a vardata_t
 void lk::vardata_t::assign(const lk_string &s) {
     assert_modify();
 
-    // checks if previously assigned
-    if (type() != STRING) {
-        nullify();
-        set_type(STRING);
-        m_u.p = new lk_string(s);
-    } else {
-        *reinterpret_cast<lk_string *>(m_u.p) = s;
+    // reuses the storage of a long string that is not shared, short ones are interned
+    if (type() == STRING && s.length() > INTERN_MAX) {
+        shared_str_t *p = str_payload(ptr());
+        if (!p->interned && p->refs.load() == 1) {
+            p->data = s;
+            return;
+        }
     }
+
+    // s may be the string being released
+    shared_str_t *p = new_str(s);
+    nullify();
+    set_ptr(STRING, p);
 }
 
 void lk::vardata_t::empty_vector() {
     assert_modify();
 
     nullify();
-    set_type(VECTOR);
-    m_u.p = new std::vector<vardata_t>;
+    set_ptr(VECTOR, new shared_vec_t);
 }
 
-void lk::vardata_t::empty_hash() {
+void lk::vardata_t::empty_hash(size_t n) {
     assert_modify();
 
     nullify();
-    set_type(HASH);
-    m_u.p = new varhash_t;
+    shared_hash_t *h = new shared_hash_t;
+    if (n > 0) h->data.reserve(n);
+    set_ptr(HASH, h);
 }
 
 void lk::vardata_t::assign(const lk_string &key, vardata_t *val) {
@@ -463,11 +895,12 @@ void lk::vardata_t::assign(const lk_string &key, vardata_t *val) {
 
     if (type() != HASH) {
         nullify();
-        set_type(HASH);
-        m_u.p = new varhash_t;
-    }
+        set_ptr(HASH, new shared_hash_t);
+    } else
+        unshare();
 
-    (*reinterpret_cast<varhash_t *>(m_u.p))[key] = val;
+    hash_data(ptr())[key].copy(*val);
+    delete val;
 }
 
 void lk::vardata_t::unassign(const lk_string &key) {
@@ -475,31 +908,26 @@ void lk::vardata_t::unassign(const lk_string &key) {
 
     if (type() != HASH) return;
 
-    varhash_t &h = (*reinterpret_cast<varhash_t *>(m_u.p));
+    unshare();
+    varhash_t &h = hash_data(ptr());
 
-    varhash_t::iterator it = h.find(key);
-    if (it != h.end()) {
-        delete (*it).second; // delete the associated data
-        h.erase(it);
-    }
+    h.erase(key);
 }
 
 void lk::vardata_t::assign(expr_t *func) {
     assert_modify();
 
     nullify();
-    set_type(FUNCTION);
-    m_u.p = func;
+    set_ptr(FUNCTION, func);
 }
 
 void lk::vardata_t::assign(vardata_t *ref) {
     assert_modify();
 
-    nullify();
-    set_type(REFERENCE);
     if (ref == this)
         throw error_t(lk_tr("internal error: assigning self-referential reference"));
-    m_u.p = ref;
+    nullify();
+    set_ptr(REFERENCE, ref);
 }
 
 /// assigns as EXTFUNC type whose value points to the function's fci
@@ -507,16 +935,14 @@ void lk::vardata_t::assign_fcall(fcallinfo_t *fci) {
     assert_modify();
 
     nullify();
-    set_type(EXTFUNC);
-    m_u.p = fci;
+    set_ptr(EXTFUNC, fci);
 }
 
 void lk::vardata_t::assign_faddr(size_t ip) {
     assert_modify();
 
     nullify();
-    set_type(INTFUNC);
-    m_u.p = (void *) ip;
+    set_ptr(INTFUNC, (void *) (ip << FADDR_SHIFT));
 }
 
 void lk::vardata_t::resize(size_t n) {
@@ -524,41 +950,94 @@ void lk::vardata_t::resize(size_t n) {
 
     if (type() != VECTOR) {
         nullify();
-        set_type(VECTOR);
-        m_u.p = new std::vector<vardata_t>;
+        set_ptr(VECTOR, new shared_vec_t);
+    } else
+        unshare();
+
+    shared_vec_t *v = vec_payload(ptr());
+    if (v->packed)
+        v->nums.resize(n, null_num());
+    else
+        v->data.resize(n);
+}
+
+void lk::vardata_t::set_num(size_t idx, double d) {
+    if (type() == VECTOR) {
+        shared_vec_t *v = vec_payload(ptr());
+        if (v->packed && idx < v->nums.size() && v->refs.load() == 1) {
+            v->nums[idx] = packed_num(d);
+            return;
+        }
     }
 
-    reinterpret_cast<std::vector<vardata_t> *>(m_u.p)->resize(n);
+    if (type() != VECTOR || length() <= idx)
+        resize(idx + 1);
+    else
+        unshare();
+
+    shared_vec_t *v = vec_payload(ptr());
+    if (v->packed)
+        v->nums[idx] = packed_num(d);
+    else
+        v->data[idx].assign(d);
 }
 
 double lk::vardata_t::num() const {
     if (type() != NUMBER) throw error_t(lk_tr("access violation: expected numeric, but found") + " " + typestr());
-    return m_u.v;
+    return dval();
 }
 
-lk_string lk::vardata_t::str() const {
+const lk_string &lk::vardata_t::str() const {
     if (type() != STRING) throw error_t(lk_tr("access violation: expected string, but found") + " " + typestr());
-    return *reinterpret_cast<lk_string *>(m_u.p);
+    return str_data(ptr());
 }
 
 lk::vardata_t *lk::vardata_t::ref() const {
     if (type() != REFERENCE)
         return 0;
     else
-        return reinterpret_cast<vardata_t *>(m_u.p);
+        return reinterpret_cast<vardata_t *>(ptr());
 }
 
 std::vector<lk::vardata_t> *lk::vardata_t::vec() const {
     if (type() != VECTOR) throw error_t(lk_tr("access violation: expected array, but found ") + " " + typestr());
-    return reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
+    own();
+    unpack();
+    return &vec_data(ptr());
+}
+
+const std::vector<lk::vardata_t> *lk::vardata_t::cvec() const {
+    if (type() != VECTOR) throw error_t(lk_tr("access violation: expected array, but found ") + " " + typestr());
+    unpack();
+    return &vec_data(ptr());
+}
+
+const std::vector<double> *lk::vardata_t::cnumvec() const {
+    if (type() != VECTOR) return 0;
+    shared_vec_t *v = vec_payload(ptr());
+    return v->packed ? &v->nums : 0;
+}
+
+void lk::vardata_t::vec_assign(const double *arr, size_t n) {
+    empty_vector();
+    std::vector<double> &nums = vec_payload(ptr())->nums;
+    nums.resize(n);
+    for (size_t i = 0; i < n; i++)
+        nums[i] = packed_num(arr[i]);
 }
 
 void lk::vardata_t::vec_append(double d) {
     assert_modify();
 
+    if (type() == VECTOR && vec_payload(ptr())->packed) {
+        unshare();
+        vec_payload(ptr())->nums.push_back(packed_num(d));
+        return;
+    }
+
     vardata_t v;
     v.assign(d);
-    vec()->push_back(v);
+    elements().push_back(v);
 }
 
 void lk::vardata_t::vec_append(const lk_string &s) {
@@ -566,19 +1045,66 @@ void lk::vardata_t::vec_append(const lk_string &s) {
 
     vardata_t v;
     v.assign(s);
-    vec()->push_back(v);
+    elements().push_back(v);
 }
 
 void lk::vardata_t::vec_append(const vardata_t vd) {
+    if (vd.type() == NUMBER) {
+        vec_append(vd.dval());
+        return;
+    }
+
+    assert_modify();
+
+    elements().push_back(vd);
+}
+
+void lk::vardata_t::vec_extend(const vardata_t &v) {
+    assert_modify();
+
+    // holds on to the elements in case v is this array
+    vardata_t items(v.deref());
+    if (items.type() != VECTOR)
+        throw error_t(lk_tr("access violation: expected array, but found") + " " + items.typestr());
+    const shared_vec_t *src = vec_payload(items.ptr());
+
+    if (type() == VECTOR && vec_payload(ptr())->packed && src->packed) {
+        unshare();
+        std::vector<double> &nums = vec_payload(ptr())->nums;
+        nums.insert(nums.end(), src->nums.begin(), src->nums.end());
+        return;
+    }
+
+    std::vector<vardata_t> &data = elements();
+    if (src->packed) {
+        size_t n = data.size();
+        data.resize(n + src->nums.size());
+        for (size_t i = 0; i < src->nums.size(); i++)
+            num_element(src->nums[i], data[n + i]);
+    } else
+        data.insert(data.end(), src->data.begin(), src->data.end());
+}
+
+void lk::vardata_t::str_append(const lk_string &s) {
     assert_modify();
 
-    vec()->push_back(vd);
+    if (type() == STRING) {
+        shared_str_t *p = str_payload(ptr());
+        if (!p->interned && p->refs.load() == 1) {
+            p->data += s;
+            return;
+        }
+    }
+
+    assign(as_string() + s);
 }
 
 size_t lk::vardata_t::length() const {
     switch (type()) {
-        case VECTOR:
-            return reinterpret_cast<std::vector<vardata_t> *>(m_u.p)->size();
+        case VECTOR: {
+            shared_vec_t *v = vec_payload(ptr());
+            return v->packed ? v->nums.size() : v->data.size();
+        }
         default:
             return 0;
     }
@@ -587,87 +1113,68 @@ size_t lk::vardata_t::length() const {
 lk::expr_t *lk::vardata_t::func() const {
     if (type() != FUNCTION)
         throw error_t(lk_tr("access violation: expected code expression pointer, but found") + " " + typestr());
-    return reinterpret_cast<expr_t *>(m_u.p);
+    return reinterpret_cast<expr_t *>(ptr());
 }
 
 lk::fcallinfo_t *lk::vardata_t::fcall() const {
     if (type() != EXTFUNC)
         throw error_t(lk_tr("access violation: expected external function pointer, but found") + " " + typestr());
-    return reinterpret_cast<fcallinfo_t *>(m_u.p);
+    return reinterpret_cast<fcallinfo_t *>(ptr());
 }
 
 size_t lk::vardata_t::faddr() const {
     if (type() != INTFUNC)
         throw error_t(lk_tr("access violation: expected internal function pointer, but found") + " " + typestr());
-    return reinterpret_cast<size_t>(m_u.p);
+    return reinterpret_cast<size_t>(ptr()) >> FADDR_SHIFT;
 }
 
 lk::varhash_t *lk::vardata_t::hash() const {
     if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
-    return reinterpret_cast<varhash_t *> (m_u.p);
+    own();
+    return &hash_data(ptr());
+}
+
+const lk::varhash_t *lk::vardata_t::chash() const {
+    if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
+    return &hash_data(ptr());
 }
 
 void lk::vardata_t::hash_item(const lk_string &key, double d) {
     assert_modify();
 
-    varhash_t *h = hash();
-    varhash_t::iterator it = h->find(key);
-    if (it != h->end())
-        (*it).second->assign(d);
-    else {
-        vardata_t *t = new vardata_t;
-        t->assign(d);
-        (*h)[key] = t;
-    }
+    entries()[key].assign(d);
 }
 
 void lk::vardata_t::hash_item(const lk_string &key, const lk_string &s) {
     assert_modify();
 
-    varhash_t *h = hash();
-    varhash_t::iterator it = h->find(key);
-    if (it != h->end())
-        (*it).second->assign(s);
-    else {
-        vardata_t *t = new vardata_t;
-        t->assign(s);
-        (*h)[key] = t;
-    }
+    entries()[key].assign(s);
 }
 
 void lk::vardata_t::hash_item(const lk_string &key, const vardata_t &v) {
     assert_modify();
 
-    varhash_t *h = hash();
-    varhash_t::iterator it = h->find(key);
-    if (it != h->end())
-        (*it).second->copy(const_cast<vardata_t &>(v));
-    else {
-        vardata_t *t = new vardata_t;
-        t->copy(const_cast<vardata_t &>(v));
-        (*h)[key] = t;
-    }
+    entries()[key].copy(v);
 }
 
 lk::vardata_t &lk::vardata_t::hash_item(const lk_string &key) {
     assert_modify();
 
-    varhash_t *h = hash();
-    varhash_t::iterator it = h->find(key);
-    if (it != h->end()) {
-        (*it).second->nullify();
-        return *(*it).second;
-    } else {
-        vardata_t *t = new vardata_t;
-        (*h)[key] = t;
-        return *t;
-    }
+    vardata_t &x = (*hash())[key];
+    x.nullify();
+    return x;
 }
 
 lk::vardata_t *lk::vardata_t::index(size_t idx) const {
+    if (type() == VECTOR) own();
+    return const_cast<vardata_t *>(cindex(idx));
+}
+
+const lk::vardata_t *lk::vardata_t::cindex(size_t idx) const {
     if (type() != VECTOR)
         throw error_t(lk_tr("access violation: expected array for indexing, but found") + " " + typestr());
-    std::vector<vardata_t> &m = *reinterpret_cast<std::vector<vardata_t> *>(m_u.p);
+    unpack();
+    const std::vector<vardata_t> &m = vec_data(ptr());
     if (idx >= m.size())
         throw error_t((const char *) lk_tr("array index out of bounds at %d (length: %d)").c_str(), (int) idx,
                       (int) m.size());
@@ -676,18 +1183,23 @@ lk::vardata_t *lk::vardata_t::index(size_t idx) const {
 }
 
 lk::vardata_t *lk::vardata_t::lookup(const lk_string &key) const {
+    if (type() == HASH) own();
+    return const_cast<vardata_t *>(clookup(key));
+}
+
+const lk::vardata_t *lk::vardata_t::clookup(const lk_string &key) const {
     if (type() != HASH) throw error_t(lk_tr("access violation: expected hash table, but found") + " " + typestr());
-    varhash_t &h = *reinterpret_cast<varhash_t *>(m_u.p);
-    varhash_t::iterator it = h.find(key);
+    const varhash_t &h = hash_data(ptr());
+    varhash_t::const_iterator it = h.find(key);
     if (it != h.end())
-        return (*it).second;
+        return &(*it).second;
     else
         return 0;
 }
 
-lk::env_t::env_t() : m_parent(0), m_varIter(m_varHash.begin()) {}
+lk::env_t::env_t() : m_parent(0), m_varIter(m_varHash.begin()), m_varRev(0), m_frozen(false), m_readonly(false) {}
 
-lk::env_t::env_t(env_t *p) : m_parent(p), m_varIter(m_varHash.begin()) {}
+lk::env_t::env_t(env_t *p) : m_parent(p), m_varIter(m_varHash.begin()), m_varRev(0), m_frozen(false), m_readonly(false) {}
 
 lk::env_t::~env_t() {
     clear_objs();
@@ -712,37 +1224,79 @@ void lk::env_t::clear_objs() {
 }
 
 void lk::env_t::clear_vars() {
-    for (varhash_t::iterator it = m_varHash.begin(); it != m_varHash.end(); ++it)
+    for (envhash_t::iterator it = m_varHash.begin(); it != m_varHash.end(); ++it)
         delete it->second; // delete the var_data object
     m_varHash.clear();
+    m_varRev++;
+}
+
+void lk::env_t::release_vars(std::vector<vardata_t *> &pool) {
+    for (envhash_t::iterator it = m_varHash.begin(); it != m_varHash.end(); ++it) {
+        vardata_t *x = it->second;
+        x->nullify();
+        x->clear_flag(vardata_t::ASSIGNED);
+        x->clear_flag(vardata_t::CONSTVAL);
+        x->clear_flag(vardata_t::GLOBALVAL);
+        pool.push_back(x);
+    }
+    m_varHash.clear();
+    m_varRev++;
 }
 
 /// assigns an identifer to a vardata_t with value
 void lk::env_t::assign(const lk_string &name, vardata_t *value) {
     vardata_t *x = lookup(name, false);
 
-    if (x && x != value)
+    if (x && x != value) {
         delete x;
+        m_varRev++;
+    }
 
     m_varHash[name] = value;
 }
 
 void lk::env_t::unassign(const lk_string &name) {
-    varhash_t::iterator it = m_varHash.find(name);
+    envhash_t::iterator it = m_varHash.find(name);
     if (it != m_varHash.end()) {
         delete (*it).second; // delete the associated data
         m_varHash.erase(it);
+        m_varRev++;
     }
 }
 
-lk::vardata_t *lk::env_t::lookup(const lk_string &name, bool search_hierarchy) {
-    varhash_t::iterator it = m_varHash.find(name);
-    if (it != m_varHash.end())
-        return (*it).second;
-    else if (search_hierarchy && m_parent)
-        return m_parent->lookup(name, true);
-    else
+lk::vardata_t *lk::env_t::detach(const lk_string &name) {
+    envhash_t::iterator it = m_varHash.find(name);
+    if (it == m_varHash.end())
         return 0;
+
+    vardata_t *x = (*it).second;
+    m_varHash.erase(it);
+    m_varRev++;
+    return x;
+}
+
+lk::vardata_t *lk::env_t::lookup(const lk_string &name, bool search_hierarchy) {
+    size_t hash = envhash_t::hash_of(name);
+    env_t *e = this, *below = 0;
+    do {
+        envhash_t::iterator it = e->m_varHash.find(name, hash);
+        if (it != e->m_varHash.end()) {
+            if (!e->m_frozen || !below)
+                return (*it).second;
+
+            // other threads read the frozen variable too: work on a copy of it from now on
+            vardata_t *x = new vardata_t(*it->second);
+            if (it->second->flagval(vardata_t::CONSTVAL)) x->set_flag(vardata_t::CONSTVAL);
+            if (it->second->flagval(vardata_t::ASSIGNED)) x->set_flag(vardata_t::ASSIGNED);
+            if (it->second->flagval(vardata_t::GLOBALVAL)) x->set_flag(vardata_t::GLOBALVAL);
+            below->m_varHash[name] = x;
+            return x;
+        }
+        below = e;
+        e = e->m_parent;
+    } while (search_hierarchy && e);
+
+    return 0;
 }
 
 bool lk::env_t::first(lk_string &key, vardata_t *&value) {
@@ -779,12 +1333,43 @@ lk::env_t *lk::env_t::parent() {
 lk::env_t *lk::env_t::global() {
     env_t *p = this;
 
-    while (p->parent())
+    while (p->parent() && !p->parent()->m_frozen)
         p = p->parent();
 
     return p;
 }
 
+lk::env_t *lk::env_t::freeze(bool read_only) {
+    env_t *f = new env_t;
+    for (env_t *e = this; e != 0; e = e->m_parent) {
+        for (envhash_t::iterator it = e->m_varHash.begin(); it != e->m_varHash.end(); ++it) {
+            if (f->m_varHash.find(it->first) != f->m_varHash.end())
+                continue;
+
+            vardata_t *x = new vardata_t(it->second->deref());
+            x->unpack_nested();
+            if (read_only || it->second->flagval(vardata_t::CONSTVAL)) x->set_flag(vardata_t::CONSTVAL);
+            if (read_only || it->second->flagval(vardata_t::ASSIGNED)) x->set_flag(vardata_t::ASSIGNED);
+            if (it->second->flagval(vardata_t::GLOBALVAL)) x->set_flag(vardata_t::GLOBALVAL);
+            f->m_varHash[it->first] = x;
+        }
+
+        for (funchash_t::iterator it = e->m_funcHash.begin(); it != e->m_funcHash.end(); ++it)
+            f->m_funcHash.insert(*it);
+    }
+
+    f->m_frozen = true;
+    f->m_readonly = read_only;
+    return f;
+}
+
+bool lk::env_t::read_only() const {
+    const env_t *e = this;
+    while (e && !e->m_frozen)
+        e = e->m_parent;
+    return e && e->m_readonly;
+}
+
 unsigned int lk::env_t::size() {
     return m_varHash.size();
 }
@@ -934,7 +1519,7 @@ void lk::env_t::call(const lk_string &name, std::vector<vardata_t> &args, vardat
         __args->empty_vector();
 
         for (size_t aidx = 0; aidx < args.size(); aidx++) {
-            __args->vec()->push_back(vardata_t(args[aidx]));
+            __args->vec_append(args[aidx]);
 
             if (argnames && aidx < argnames->items.size()) {
                 if (iden_t *id = dynamic_cast<iden_t *>(argnames->items[aidx]))
@@ -99,14 +99,16 @@ bool lk::eval::special_get(const lk_string &name, vardata_t &) {
 
 static void do_plus_eq(lk::vardata_t &l, lk::vardata_t &r) {
     if (l.deref().type() == lk::vardata_t::STRING)
-        l.deref().assign(l.deref().as_string() + r.deref().as_string());
+        l.deref().str_append(r.deref().as_string());
     else if (l.deref().type() == lk::vardata_t::VECTOR) {
-        if (r.deref().type() == lk::vardata_t::VECTOR) {
-            for (size_t i = 0; i < r.deref().length(); i++)
-                l.deref().vec()->push_back(*r.deref().index(i));
-        } else
+        // an array inside the value is appended a copy of the value, as in  x[0] += x;
+        lk::vardata_t items(r.deref());
+        items.unshare_path(&l.deref());
+        if (items.type() == lk::vardata_t::VECTOR)
+            l.deref().vec_extend(items);
+        else
             // append to the vector
-            l.deref().vec()->push_back(r.deref());
+            l.deref().vec_append(items);
     } else
         l.deref().assign(l.deref().num() + r.deref().as_number());
 }
@@ -250,10 +252,7 @@ bool lk::eval::interpret(node_t *root,
                     ok = ok && interpret(n4->left, cur_env, l, flags, ctl_id);
 
                     if (l.deref().type() == vardata_t::HASH) {
-                        lk::varhash_t *hh = l.deref().hash();
-                        lk::varhash_t::iterator it = hh->find(r.deref().as_string());
-                        if (it != hh->end())
-                            hh->erase(it);
+                        l.deref().hash()->erase(r.deref().as_string());
                     } else if (l.deref().type() == vardata_t::VECTOR) {
                         std::vector<lk::vardata_t> *vv = l.deref().vec();
                         size_t idx = r.deref().as_unsigned();
@@ -295,7 +294,7 @@ bool lk::eval::interpret(node_t *root,
 
                     // otherwise evaluate the LHS in a mutable context, as normal.
                     ok = ok && interpret(n4->left, cur_env, l, flags | ENV_MUTABLE, ctl_id);
-                    l.deref().copy(r.deref());
+                    l.deref().store(r.deref());
                     result.copy(r.deref());
                     return ok;
                 case expr_t::LOGIOR:
@@ -437,8 +436,7 @@ bool lk::eval::interpret(node_t *root,
                         else
                             result.assign(x);
                     } else if ((flags & ENV_MUTABLE)) {
-                        hash.assign(val.as_string(), x = new vardata_t);
-                        result.assign(x);
+                        result.assign(&hash.hash_item(val.as_string()));
                     } else
                         result.nullify();
 
@@ -613,7 +611,7 @@ bool lk::eval::interpret(node_t *root,
                         for (varhash_t::iterator it = h->begin();
                              it != h->end();
                              ++it) {
-                            if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                            if ((*it).second.deref().type() != vardata_t::NULLVAL)
                                 count++;
                         }
                         result.assign(count);
@@ -633,7 +631,7 @@ bool lk::eval::interpret(node_t *root,
                         for (varhash_t::iterator it = h->begin();
                              it != h->end();
                              ++it) {
-                            if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                            if ((*it).second.deref().type() != vardata_t::NULLVAL)
                                 result.vec_append((*it).first);
                         }
                         return true;
@@ -677,13 +675,7 @@ bool lk::eval::interpret(node_t *root,
                                      && interpret(assign->right, cur_env, vval, flags, ctl_id);
 
                                 if (ok) {
-                                    lk_string key = vkey.as_string();
-                                    varhash_t *h = result.hash();
-                                    varhash_t::iterator it = h->find(key);
-                                    if (it != h->end())
-                                        (*it).second->copy(vval.deref());
-                                    else
-                                        (*h)[key] = new vardata_t(vval.deref());
+                                    result.hash_item(vkey.as_string(), vval.deref());
                                 }
                             }
                         }
@@ -23,6 +23,7 @@
 **********************************************************************************************************************/
 
 #include <cstring>
+#include <algorithm>
 
 #include <lk/env.h>
 #include <lk/invoke.h>
@@ -190,13 +191,24 @@ void _CC_set_number(struct __lk_invoke_t *, lk_var_t vv, double val) {
 }
 
 void _CC_set_number_vec(struct __lk_invoke_t *, lk_var_t vv, double *arr, int len) {
-    if (vv != 0 && arr != 0 && len > 0) {
-        lk::vardata_t &v = *((lk::vardata_t *) vv);
-        v.empty_vector();
-        v.vec()->reserve(len);
-        for (int i = 0; i < len; i++)
-            v.vec_append(arr[i]);
+    if (vv != 0 && arr != 0 && len > 0)
+        ((lk::vardata_t *) vv)->vec_assign(arr, (size_t) len);
+}
+
+int _CC_get_number_vec(struct __lk_invoke_t *, lk_var_t vv, double *arr, int len) {
+    if (vv == 0 || arr == 0 || len <= 0) return 0;
+
+    lk::vardata_t &v = *((lk::vardata_t *) vv);
+    int n = std::min(len, (int) v.length());
+    if (const std::vector<double> *nv = v.cnumvec()) {
+        for (int i = 0; i < n; i++)
+            arr[i] = lk::vardata_t::is_null_num((*nv)[i]) ? 0.0 : (*nv)[i];
+    } else {
+        for (int i = 0; i < n; i++)
+            arr[i] = v.cindex(i)->as_number();
     }
+
+    return n;
 }
 
 void _CC_make_vec(struct __lk_invoke_t *, lk_var_t vv) {
@@ -367,6 +379,7 @@ namespace lk {
         ext_call.append_call_arg = _CC_append_call_arg;
         ext_call.call_result = _CC_call_result;
         ext_call.call = _CC_call;
+        ext_call.get_number_vec = _CC_get_number_vec;
 
         // call the function with the pointer
         p(&ext_call);
@@ -0,0 +1,404 @@
+/***********************************************************************************************************************
+*  LK, Copyright (c) 2008-2017, Alliance for Sustainable Energy, LLC. All rights reserved.
+*
+*  Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+*  following conditions are met:
+*
+*  (1) Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*  disclaimer.
+*
+*  (2) Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+*  following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+*  (3) Neither the name of the copyright holder nor the names of any contributors may be used to endorse or promote
+*  products derived from this software without specific prior written permission from the respective party.
+*
+*  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+*  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+*  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER, THE UNITED STATES GOVERNMENT, OR ANY CONTRIBUTORS BE LIABLE FOR
+*  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+*  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+*  AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+*  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**********************************************************************************************************************/
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+
+#include <lk/parallel.h>
+#include <lk/parse.h>
+#include <lk/codegen.h>
+
+// index of the pool worker running on this thread, or -1 on other threads
+static thread_local size_t this_worker = (size_t) -1;
+
+lk::thread_pool::group::group() : m_pending(0) {
+}
+
+void lk::thread_pool::group::wait() {
+    finish();
+
+    std::exception_ptr e;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        std::swap(e, m_error);
+    }
+    if (e) std::rethrow_exception(e);
+}
+
+void lk::thread_pool::group::finish() {
+    thread_pool &pool = instance();
+
+    // tasks run here get a vm of their own, as a task calling wait() may be using its worker's
+    std::unique_ptr<vm> helper;
+    while (m_pending > 0) {
+        task t;
+        if (pool.take(this_worker, t)) {
+            if (!helper) helper.reset(new vm);
+            pool.run(t, *helper);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(pool.m_sleep);
+        while (m_pending > 0 && pool.m_queued == 0)
+            pool.m_wake.wait(lock);
+    }
+}
+
+lk::thread_pool &lk::thread_pool::instance() {
+    // never destroyed: idle workers are left blocked when the process exits, rather than being
+    // joined after other static objects their vms refer to may have gone
+    static thread_pool *pool = new thread_pool;
+    return *pool;
+}
+
+lk::thread_pool::thread_pool() : m_next(0), m_queued(0), m_stop(false) {
+    start(0);
+}
+
+void lk::thread_pool::set_size(size_t n) {
+    std::lock_guard<std::mutex> lock(m_resize);
+    stop();
+    start(n);
+}
+
+size_t lk::thread_pool::size() {
+    return m_workers.size();
+}
+
+void lk::thread_pool::start(size_t n) {
+    if (n == 0) n = std::thread::hardware_concurrency();
+    if (n == 0) n = 1;
+
+    m_stop = false;
+    for (size_t i = 0; i < n; i++)
+        m_workers.push_back(new worker);
+
+    // every queue exists before any worker starts stealing
+    for (size_t i = 0; i < n; i++)
+        m_workers[i]->thread = std::thread(&thread_pool::work, this, i);
+}
+
+void lk::thread_pool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_sleep);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    // workers still stealing look into every queue, so none is deleted before all have finished
+    for (size_t i = 0; i < m_workers.size(); i++)
+        m_workers[i]->thread.join();
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+        delete m_workers[i];
+    m_workers.clear();
+}
+
+void lk::thread_pool::submit(group &g, task_func f, void *data) {
+    task t;
+    t.func = f;
+    t.data = data;
+    t.owner = &g;
+
+    size_t n = m_workers.size();
+    size_t i = this_worker < n ? this_worker : m_next++ % n;
+    g.m_pending++;
+
+    {
+        // counted before it is queued, so that m_queued never drops below the tasks queued
+        std::lock_guard<std::mutex> lock(m_sleep);
+        m_queued++;
+        std::lock_guard<std::mutex> qlock(m_workers[i]->lock);
+        m_workers[i]->tasks.push_back(t);
+    }
+    m_wake.notify_one();
+}
+
+void lk::thread_pool::work(size_t i) {
+    this_worker = i;
+    worker &w = *m_workers[i];
+
+    for (;;) {
+        task t;
+        if (take(i, t)) {
+            run(t, w.machine);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_sleep);
+        while (!m_stop && m_queued == 0)
+            m_wake.wait(lock);
+
+        if (m_stop && m_queued == 0)
+            return;
+    }
+}
+
+bool lk::thread_pool::take(size_t i, task &t) {
+    size_t n = m_workers.size();
+    if (i < n) {
+        worker &w = *m_workers[i];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (!w.tasks.empty()) {
+            t = w.tasks.back();
+            w.tasks.pop_back();
+            m_queued--;
+            return true;
+        }
+    }
+
+    for (size_t k = 1; k <= n; k++) {
+        size_t j = ((i < n ? i : 0) + k) % n;
+        if (j == i) continue;
+
+        worker &w = *m_workers[j];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (!w.tasks.empty()) {
+            t = w.tasks.front();
+            w.tasks.pop_front();
+            m_queued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void lk::thread_pool::run(task &t, vm &v) {
+    // an exception escaping a task must not take the worker down with it: it goes to the waiter
+    try {
+        t.func(t.data, v);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(t.owner->m_lock);
+        if (!t.owner->m_error)
+            t.owner->m_error = std::current_exception();
+    }
+
+    // the next task loads its own bytecode: drop this one's variables now
+    v.load(0);
+
+    if (--t.owner->m_pending == 0) {
+        std::lock_guard<std::mutex> lock(m_sleep);
+        m_wake.notify_all();
+    }
+}
+
+struct lk::sweep::job {
+    const sweep *owner;
+    const std::vector<vardata_t> *cases;
+    std::vector<vardata_t> *results;
+    env_t *env;
+    std::atomic<size_t> next;
+};
+
+lk::sweep::sweep() : m_compiled(false), m_threads(0) {
+}
+
+bool lk::sweep::compile(const lk_string &script, lk_string *err) {
+    m_compiled = false;
+    m_bc = bytecode();
+
+    lk::input_string p(script);
+    lk::parser parse(p);
+    std::unique_ptr<lk::node_t> tree(parse.script());
+
+    lk_string msg;
+    for (int i = 0; i < parse.error_count(); i++)
+        msg += parse.error(i) + "\n";
+
+    if (msg.empty() && parse.token() != lk::lexer::END)
+        msg = lk_tr("parsing did not reach end of input") + "\n";
+
+    if (msg.empty()) {
+        codegen cg;
+        if (cg.generate(tree.get())) {
+            cg.get(m_bc);
+            m_compiled = true;
+        } else
+            msg = cg.error();
+    }
+
+    if (err) *err = msg;
+    return m_compiled;
+}
+
+void lk::sweep::run(const std::vector<vardata_t> &cases, std::vector<vardata_t> &results, env_t *env) {
+    results.assign(cases.size(), vardata_t());
+    if (cases.empty())
+        return;
+
+    thread_pool &pool = thread_pool::instance();
+    size_t ntasks = m_threads > 0 ? m_threads : pool.size();
+    ntasks = std::min(std::max(ntasks, (size_t) 1), cases.size());
+
+    // cases may share values, such as one common to all of them
+    std::vector<vardata_t> inputs(cases);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        vardata_t &in = inputs[i].deref();
+        if (in.type() == vardata_t::HASH) {
+            varhash_t &h = *in.hash();
+            for (varhash_t::iterator it = h.begin(); it != h.end(); ++it)
+                it->second.unpack_nested();
+        }
+    }
+
+    std::unique_ptr<env_t> frozen(env ? env->freeze() : 0);
+
+    job j;
+    j.owner = this;
+    j.cases = &inputs;
+    j.results = &results;
+    j.env = frozen.get();
+    j.next = 0;
+
+    thread_pool::group g;
+    for (size_t i = 0; i < ntasks; i++)
+        pool.submit(g, &sweep::work, &j);
+    g.wait();
+}
+
+void lk::sweep::work(void *data, vm &v) {
+    job *j = reinterpret_cast<job *>(data);
+
+    size_t i;
+    while ((i = j->next++) < j->cases->size()) {
+        vardata_t &result = (*j->results)[i];
+        try {
+            j->owner->run(v, (*j->cases)[i], result, j->env);
+        } catch (std::exception &e) {
+            if (result.type() != vardata_t::HASH)
+                result.empty_hash();
+            result.hash_item("error", lk_string(e.what()));
+        }
+    }
+}
+
+void lk::sweep::run(vm &v, const vardata_t &input, vardata_t &result, env_t *env) const {
+    result.empty_hash();
+    if (!m_compiled) {
+        result.hash_item("error", lk_tr("no script compiled"));
+        return;
+    }
+
+    const vardata_t &in = input.deref();
+    if (in.type() != vardata_t::HASH) {
+        result.hash_item("error", lk_tr("case inputs must be a table"));
+        return;
+    }
+
+    // variables found in a frozen env are copied into this run's own scope
+    env_t scope(env);
+    if (v.get_bytecode() != &m_bc)
+        v.load(&m_bc);
+    if (!v.initialize(&scope)) {
+        result.hash_item("error", v.error());
+        return;
+    }
+
+    // the inputs are variables of the global frame, as if the script began by assigning them
+    size_t nfrm;
+    env_t &inputs = v.get_frames(&nfrm)[0]->env;
+    for (varhash_t::const_iterator it = in.chash()->begin(); it != in.chash()->end(); ++it)
+        inputs.assign(it->first, new vardata_t(it->second));
+
+    bool ok = v.run();
+
+    env_t &globals = v.get_frames(&nfrm)[0]->env;
+    if (m_outputs.empty()) {
+        lk_string key;
+        vardata_t *x;
+        for (bool more = globals.first(key, x); more; more = globals.next(key, x)) {
+            unsigned char ty = x->deref().type();
+            if (ty != vardata_t::FUNCTION && ty != vardata_t::INTFUNC && ty != vardata_t::EXTFUNC)
+                result.hash_item(key, x->deref());
+        }
+    } else {
+        for (size_t i = 0; i < m_outputs.size(); i++)
+            if (vardata_t *x = globals.lookup(m_outputs[i], false))
+                result.hash_item(m_outputs[i], x->deref());
+    }
+
+    if (!ok)
+        result.hash_item("error", v.error());
+}
+
+struct call_job {
+    const lk::bytecode *bc;
+    size_t faddr;
+    std::vector<lk::vardata_t> items;
+    std::vector<lk::vardata_t> *results;
+    std::vector<lk_string> *errors;
+    lk::env_t *env; ///< frozen, read only
+    std::atomic<size_t> next;
+};
+
+static void run_calls(void *data, lk::vm &v) {
+    call_job *j = reinterpret_cast<call_job *>(data);
+
+    v.load(j->bc);
+    std::vector<lk::vardata_t> args(1);
+    size_t i;
+    while ((i = j->next++) < j->items.size()) {
+        // each call runs below a scope of its own, which takes copies of the variables it uses,
+        // so that no call sees what another changed in them whichever worker ran it
+        lk::env_t scope(j->env);
+        try {
+            args[0].copy(j->items[i]);
+            if (!v.initialize(&scope) || !v.call(j->faddr, args, (*j->results)[i]))
+                (*j->errors)[i] = v.error();
+        } catch (std::exception &e) {
+            (*j->errors)[i] = e.what();
+        }
+    }
+}
+
+void lk::parallel_call(const bytecode *bc, size_t faddr, const std::vector<vardata_t> &items,
+                       std::vector<vardata_t> &results, std::vector<lk_string> &errors, env_t *env) {
+    results.assign(items.size(), vardata_t());
+    errors.assign(items.size(), lk_string());
+    if (items.empty())
+        return;
+
+    std::unique_ptr<env_t> frozen(env ? env->freeze(true) : 0);
+
+    call_job j;
+    j.bc = bc;
+    j.faddr = faddr;
+    j.items = items;
+    for (size_t i = 0; i < j.items.size(); i++)
+        j.items[i].unpack_nested();
+    j.results = &results;
+    j.errors = &errors;
+    j.env = frozen.get();
+    j.next = 0;
+
+    thread_pool &pool = thread_pool::instance();
+    size_t ntasks = std::min(pool.size(), items.size());
+
+    thread_pool::group g;
+    for (size_t i = 0; i < ntasks; i++)
+        pool.submit(g, run_calls, &j);
+    g.wait();
+}
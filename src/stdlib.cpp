@@ -30,6 +30,7 @@
 #include <algorithm>
 #include <limits>
 #include <climits>
+#include <memory>
 // threading
 #include <thread>
 #include <future>
@@ -45,6 +46,7 @@
 #include <lk/vm.h>
 #include <lk/parse.h>
 #include <lk/codegen.h>
+#include <lk/parallel.h>
 
 
 #include <lk/sqlite3.h>
@@ -968,488 +970,291 @@ static void _ostype(lk::invoke_t &cxt) {
 }
 
 
-// async thread function
-lk_string async_func_thread(lk::invoke_t *cxt) {
-    lk_string ret_str = "";
-
-// checking for bottlenecks
-    std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-    lk_string env_time, vminit_time, vmrun_time, rt_time;
-
-
-    lk::env_t myenv(cxt->env());
-    myenv.set_parent(cxt->env());
-
-//
-    auto end = std::chrono::system_clock::now();
-    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    env_time = " Env time: " + std::to_string(diff) + "ms ";
-
-
-    lk::vm myvm;
-
-//
-    start = std::chrono::system_clock::now();
-
-
-    myvm.load(cxt->bc());
-
-
-    myvm.initialize(&myenv);
-//
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    vminit_time = " vm init time: " + std::to_string(diff) + "ms ";
-    start = std::chrono::system_clock::now();
-
-    myvm.run();
-
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    vmrun_time = " run time: " + std::to_string(diff) + "ms ";
-
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    rt_time = " result lookup time: " + std::to_string(diff) + "ms ";
-    ret_str += env_time + vmrun_time + rt_time + "\n";
+// reads the script run by sweep(), async() and promise()
+static bool read_script(const lk_string &file, lk_string &text) {
+    FILE *fp = fopen((const char *) file.c_str(), "r");
+    if (!fp)
+        return false;
 
-    return ret_str;
+    char buf[1024];
+    while (fgets(buf, 1023, fp) != 0)
+        text += buf;
+    fclose(fp);
+    return true;
 }
 
+// compiles the script file given as the first argument of sweep(), async() or promise()
+static bool compile_script(lk::invoke_t &cxt, const char *func, lk::sweep &sw) {
+    lk_string file = cxt.arg(0).as_string(), script, err;
+    if (!read_script(file, script)) {
+        cxt.error(lk_string(func) + ": could not read " + file);
+        return false;
+    }
 
-static void _async_func(lk::invoke_t &cxt) {
-    LK_DOC("async_func", "For running function in a thread using std::async.",
-           "(string: lk function containg lk code to run in separate thread, string: variable to set for each separate thread, vector: arguments for variable for each thread, string: output variable to retrieve after thread finishes):vector");
-    // wrapper around std::async to run functions with argument
-    // will use std::promise, std::future in combination with std::package or std::async
-    //lk_string func_name = cxt.arg(0).as_string();
-
-// checking for bottlenecks
-    std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-    lk_string file_time, loop_time;
-
-    cxt.user_data();
-
-    lk_string fnc = cxt.arg(0).as_string();
+    if (!sw.compile(script, &err)) {
+        cxt.error(err);
+        return false;
+    }
+    return true;
+}
 
-    lk::vardata_t *v;
-    lk_string key;
+// returns the result variable of each run, or its error, for async() and promise()
+static void return_results(lk::invoke_t &cxt, const std::vector<lk::vardata_t> &results, const lk_string &result_name) {
     cxt.result().empty_vector();
-
-
-    if (cxt.env()->first(key, v)) {
-        cxt.result().vec_append(key + "=" + v->as_string() + "\n");
-        while (cxt.env()->next(key, v)) {
-            cxt.result().vec_append(key + "=" + v->as_string() + "\n");
-            if (v->type() == lk::vardata_t::INTFUNC) {
-            }
-        }
-    } else
-        cxt.result().vec_append("Empty environment\n");
-
-    std::vector<lk_string> funcs = cxt.env()->list_funcs();
-    for (size_t i = 0; i < funcs.size(); i++) {
-        cxt.result().vec_append(funcs[i] + "\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        if (lk::vardata_t *x = results[i].lookup("error"))
+            cxt.result().vec_append("error running vm: " + x->as_string());
+        else if (lk::vardata_t *x = results[i].lookup(result_name))
+            cxt.result().vec_append(*x);
+        else
+            cxt.result().vec_append(result_name + " lookup error");
     }
+}
 
+static void _sweep(lk::invoke_t &cxt) {
+    LK_DOC("sweep",
+           "Runs a script file once for each case in an array of tables, in parallel. The script is compiled once, and the entries of each table are assigned as global variables before its run. Returns a table for each case, in order, holding the global variables of its run, or only those named in outputs, and an 'error' entry if the run failed. At most the given number of cases run at once, by default as many as the thread pool has workers.",
+           "(string:file, array:cases, [string or array:outputs], [number:threads]):array");
 
+    lk::vardata_t &cases = cxt.arg(1).deref();
+    if (cases.type() != lk::vardata_t::VECTOR) {
+        cxt.error("sweep: cases must be an array of tables");
+        return;
+    }
 
+    lk::sweep sw;
+    if (!compile_script(cxt, "sweep", sw))
+        return;
 
-//
-    auto end = std::chrono::system_clock::now();
-    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    file_time = " List time: " + std::to_string(diff) + "ms ";
+    if (cxt.arg_count() > 2) {
+        lk::vardata_t &names = cxt.arg(2).deref();
+        std::vector<lk_string> outputs;
+        if (names.type() == lk::vardata_t::VECTOR) {
+            for (size_t i = 0; i < names.length(); i++)
+                outputs.push_back(names.index(i)->as_string());
+        } else
+            outputs.push_back(names.as_string());
+        sw.set_outputs(outputs);
+    }
 
-//
-    start = std::chrono::system_clock::now();
+    if (cxt.arg_count() > 3)
+        sw.set_threads(cxt.arg(3).as_unsigned());
 
+    std::vector<lk::vardata_t> results;
+    sw.run(*cases.vec(), results, cxt.env());
 
-//
+    cxt.result().empty_vector();
+    cxt.result().resize(results.size());
+    for (size_t i = 0; i < results.size(); i++)
+        cxt.result().index(i)->copy(results[i]);
+}
 
-    // testing with vector and then will move to table or other files as inputs.
-    if (cxt.arg(2).deref().type() == lk::vardata_t::VECTOR) {
-        int num_threads = cxt.arg(2).length();
-        cxt.result().empty_vector();
+static void _async(lk::invoke_t &cxt) {
+    LK_DOC("async",
+           "Runs a script file once for each value of an input variable, in parallel, optionally also setting a variable common to all runs. Returns the value of the result variable of each run, in order, or the error message of a run that failed. See sweep().",
+           "(string:file, string:input variable, array:input values, [string:result variable, default lk_result], [string:common variable, any:common value]):array");
 
-        // std::async implementation - speed up of about 5.2 for 8 threads or more
-        std::vector<std::future<lk_string> > results;
-        std::vector<lk::vardata_t> args;
+    lk::sweep sw;
+    if (!compile_script(cxt, "async", sw))
+        return;
 
-        for (int i = 0; i < num_threads; i++) {
-//				lk::env_t env(cxt.env());
-            //lk_string lks = cxt.arg(1).as_string() + "=" + cxt.arg(2).vec()->at(i).as_string() + ";\n" + file_contents + "\n";
-//				async_func_thread( lk::env_t &env, lk::vardata_t &vin, lk_string &fnc)
-            results.push_back(std::async(std::launch::async, async_func_thread, &cxt));
-        }
-        // Will block till data is available in future<std::string> object.
-        for (int i = 0; i < num_threads; i++) {
-            cxt.result().vec_append(results[i].get());
-        }
+    lk_string result_name = "lk_result";
+    if (cxt.arg_count() > 3)
+        result_name = cxt.arg(3).as_string();
+    sw.set_outputs(std::vector<lk_string>(1, result_name));
 
+    lk_string input_name = cxt.arg(1).as_string();
+    lk::vardata_t &values = cxt.arg(2).deref();
+    std::vector<lk::vardata_t> cases(values.length()), results;
+    for (size_t i = 0; i < cases.size(); i++) {
+        cases[i].empty_hash();
+        cases[i].hash_item(input_name, *values.index(i));
+        if (cxt.arg_count() > 5)
+            cases[i].hash_item(cxt.arg(4).as_string(), cxt.arg(5).deref());
     }
-//
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    loop_time = " loop time: " + std::to_string(diff) + "ms \n";
-    cxt.result().vec_append(file_time + loop_time);
-
 
+    sw.run(cases, results, cxt.env());
+    return_results(cxt, results, result_name);
 }
 
 
-// async thread function
-lk_string async_thread(lk::invoke_t cxt, lk::bytecode lkbc, lk_string lk_result, lk_string input_name,
-                       lk::vardata_t input_value) {
-    lk_string ret_str = "";
-
-    lk_string parse_time, env_time, bc_time, vminit_time, vmrun_time, rt_time;
-
-//
-    std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-
-//	lk::env_t myenv(cxt.env()->parent());
-    lk::env_t myenv(cxt.env());
-    /*
-	myenv.register_funcs(lk::stdlib_basic());
-	myenv.register_funcs(lk::stdlib_sysio());
-	myenv.register_funcs(lk::stdlib_math());
-	myenv.register_funcs(lk::stdlib_string());
-	*/
-//	if (input_value != NULL)
-/*	{
-		lk::vardata_t vd(input_value);
-		myenv.assign(input_name, &vd);
-	}
-*/
-//
-    auto end = std::chrono::system_clock::now();
-    auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    env_time = " Env time: " + std::to_string(diff) + "ms ";
-
-
-    lk::vm myvm;
-    lk::bytecode bc(lkbc); // can explicitly copy if in doubt
-//
-
-
-//
-    start = std::chrono::system_clock::now();
+static void _async_func(lk::invoke_t &cxt) {
+    LK_DOC("async_func",
+           "Runs a string of LK code once for each value of an input variable, in parallel. Returns the value of the result variable of each run, in order, or the error message of a run that failed. See async().",
+           "(string:code, string:input variable, array:input values, [string:result variable, default lk_result]):array");
 
-    // Get string value of "ASSIGN|VALUE|HERE" set in _async and then update to input value
-    size_t ndx_c = bc.constants.size() + 1;
-    for (size_t i = 0; i < bc.constants.size(); i++) {
-        if (bc.constants[i].type() == lk::vardata_t::STRING) {
-            if (bc.constants[i].as_string() == "ASSIGN|VALUE|HERE") {
-                ndx_c = i;
-                break;
-            }
-        }
+    lk::sweep sw;
+    lk_string err;
+    if (!sw.compile(cxt.arg(0).as_string(), &err)) {
+        cxt.error(err);
+        return;
     }
 
-    if (ndx_c > bc.constants.size()) {
-        ret_str = "async_thread: No value found to change.";
-        return ret_str;
-    } else {
-        bc.constants[ndx_c] = input_value;
+    lk::vardata_t &values = cxt.arg(2).deref();
+    if (values.type() != lk::vardata_t::VECTOR) {
+        cxt.error("async_func: input values must be an array");
+        return;
     }
 
+    lk_string result_name = "lk_result";
+    if (cxt.arg_count() > 3)
+        result_name = cxt.arg(3).as_string();
+    sw.set_outputs(std::vector<lk_string>(1, result_name));
 
-    myvm.load(&bc);
-    myvm.initialize(&myenv);
-//		myvm.initialize(cxt.env()->parent());
-
-    /* assigned to frame but not to identifier
-	size_t nfrms;
-	lk::vm::frame **frames = myvm.get_frames(&nfrms);
-	if (nfrms > 0)
-	{
-		lk::vardata_t vd(input_value);
-		lk::vm::frame &F = *frames[0];
-		F.env.assign(input_name, &vd);
-	}
-	*/
-
-
-    //
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    vminit_time = " vm init time: " + std::to_string(diff) + "ms ";
-    start = std::chrono::system_clock::now();
-
-    bool ok1 = myvm.run();
-//
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    vmrun_time = " vm run time: " + std::to_string(diff) + "ms ";
-
-    if (ok1) {
-
-//
-        start = std::chrono::system_clock::now();
-
-/*			lk::vardata_t *vd = myenv.lookup(lk_result, true);
-			if (vd)
-			{
-				ret_str += (vd->as_string());
-			}
-			else
-			{
-*/        size_t nfrm;
-        lk::vardata_t *v;
-        lk::vm::frame **frames = myvm.get_frames(&nfrm);
-        bool found = false;
-        for (size_t i = 0; i < nfrm; i++) {
-            lk::vm::frame &F = *frames[nfrm - i - 1];
-            if ((v = F.env.lookup(lk_result, true)) != NULL) {
-                ret_str += (v->as_string());
-                found = true;
-                break;
-            }
-        }
-        if (!found)
-            ret_str += (lk_result + " lookup error");
+    lk_string input_name = cxt.arg(1).as_string();
+    std::vector<lk::vardata_t> cases(values.length()), results;
+    for (size_t i = 0; i < cases.size(); i++) {
+        cases[i].empty_hash();
+        cases[i].hash_item(input_name, *values.index(i));
     }
-//		}
-    else
-        ret_str += ("error running vm: " + myvm.error());
 
-    end = std::chrono::system_clock::now();
-    diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-    rt_time = " result lookup time: " + std::to_string(diff) + "ms ";
-    ret_str += "\n" + parse_time + env_time + bc_time + vminit_time + vmrun_time + rt_time + "\n";
-
-    return ret_str;
+    sw.run(cases, results, cxt.env());
+    return_results(cxt, results, result_name);
 }
 
+// one run of promise(), as a thread pool task
+struct promise_task {
+    const lk::sweep *sw;
+    lk::env_t *env; ///< frozen
+    lk::vardata_t input;
+    std::promise<lk::vardata_t> result;
+};
 
-// async thread function
-void async_thread_promise(lk_string lks, std::shared_ptr<std::promise<lk_string>> pobj) {
-    //pobj.set_value(  async_thread(lks));
+static void run_promise(void *data, lk::vm &v) {
+    promise_task *task = reinterpret_cast<promise_task *>(data);
+    try {
+        lk::vardata_t result;
+        task->sw->run(v, task->input, result, task->env);
+        task->result.set_value(result);
+    } catch (...) {
+        task->result.set_exception(std::current_exception());
+    }
 }
 
+static void _promise(lk::invoke_t &cxt) {
+    LK_DOC("promise",
+           "Runs a script file once for each value of an input variable on the shared thread pool, each run fulfilling a std::promise with its results. Returns the value of the result variable of each run, in order, or the error message of a run that failed.",
+           "(string:file, string:input variable, array:input values, [string:result variable, default lk_result]):array");
 
-static void _async(lk::invoke_t &cxt) {
-    LK_DOC("async", "For running function in a thread using std::async.",
-           "(string: file containg lk code to run in separate thread, string: variable to set for each separate thread, vector: arguments for variable for each thread, [string: name of result variable to get from threaded script, string: global variable to set, lk value of global]");
-    // wrapper around std::async to run functions with argument
-    // will use std::promise, std::future in combination with std::package or std::async
-    //lk_string func_name = cxt.arg(0).as_string();
-
-// checking for bottlenecks
-    std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-    lk_string file_time, parse_time, bc_time, add_input_time, loop_time;
-    cxt.result().empty_vector();
-
-
-    lk_string fn = cxt.arg(0).as_string();
-    FILE *fp = fopen(fn.c_str(), "r");
-    if (!fp)
-        cxt.result().vec_append("No valid input file specified\n");
-    else {
-        lk_string file_contents;
-        char buf[1024];
-        while (fgets(buf, 1023, fp) != 0)
-            file_contents += buf;
-        fclose(fp);
-
-
-//
-        auto end = std::chrono::system_clock::now();
-        auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        file_time = " File time: " + std::to_string(diff) + "ms ";
-
-
-
-
-// additional input time
-        start = std::chrono::system_clock::now();
-
-
-// add input value
-        // required input - changes in each thread
-        lk_string input_name = cxt.arg(1).as_string();
-        lk_string value = "\"ASSIGN|VALUE|HERE\";\n";
-        file_contents = input_name + "=" + value + file_contents;
-
-        // optional global additional input - e.g. hash for pvrpm same for all threads
-        if (cxt.arg_count() > 5) {
-            lk_string add_input_name = cxt.arg(4).as_string();
-            value = "\"ADDITIONALASSIGN|VALUE|HERE\";\n";
-            lk::vardata_t add_input_value = cxt.arg(5);
-            file_contents = add_input_name + "=" + value + file_contents;
-        }
-
-
-// file contents parsed to node_t
-// checking for bottlenecks
-//	start = std::chrono::system_clock::now();
-
-        lk::input_string p(file_contents);
-        lk::parser parse(p);
-        std::unique_ptr<lk::node_t> tree(parse.script());
-        size_t i = 0;
-        while ((int) i < parse.error_count())
-            cxt.result().vec_append(lk_string(parse.error(i++)) + "\n");
-
-        if (parse.token() != lk::lexer::END)
-            cxt.result().vec_append("parsing did not reach end of input\n");
-
-        if (cxt.result().vec()->size() > 0) return;
-
-//
-        end = std::chrono::system_clock::now();
-        diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        parse_time = " Parse time: " + std::to_string(diff) + "ms ";
-
-
-// bytecode time
-        start = std::chrono::system_clock::now();
-
-        lk::bytecode bc;
-        lk::codegen cg;
-        if (cg.generate(tree.get()))
-            cg.get(bc);
-        else
-            cxt.result().vec_append("bytecode not generated.\n");
-
-//
-        end = std::chrono::system_clock::now();
-        diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        bc_time = " bytecode time: " + std::to_string(diff) + "ms ";
-
-
-        start = std::chrono::system_clock::now();
-
-// additional common inputs; e.g., meta hash for pvrpm
-
-        if (cxt.arg_count() > 5) {
-            // replace bc.constants with updated lk:vardata_t input value
-            value = "ADDITIONALASSIGN|VALUE|HERE";
-            size_t ndx_c = bc.constants.size() + 1;
-            for (i = 0; i < bc.constants.size(); i++) {
-                if (bc.constants[i].type() == lk::vardata_t::STRING) {
-                    if (bc.constants[i].as_string() == value) {
-                        ndx_c = i;
-                        break;
-                    }
-                }
-            }
+    lk::sweep sw;
+    if (!compile_script(cxt, "promise", sw))
+        return;
 
-            if (ndx_c > bc.constants.size()) {
-                cxt.result().vec_append("_async: No additional input value found to change.\n");
-            } else {
-                lk::vardata_t add_input_value = cxt.arg(5);
-                bc.constants[ndx_c] = add_input_value;
-            }
+    lk_string result_name = "lk_result";
+    if (cxt.arg_count() > 3)
+        result_name = cxt.arg(3).as_string();
+    sw.set_outputs(std::vector<lk_string>(1, result_name));
+
+    lk_string input_name = cxt.arg(1).as_string();
+    lk::vardata_t &values = cxt.arg(2).deref();
+    std::vector<promise_task> tasks(values.length());
+    std::vector<std::future<lk::vardata_t> > futures;
+    std::unique_ptr<lk::env_t> frozen(cxt.env()->freeze());
+    lk::thread_pool::group g;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        tasks[i].sw = &sw;
+        tasks[i].env = frozen.get();
+        tasks[i].input.empty_hash();
+        tasks[i].input.hash_item(input_name, *values.index(i));
+        futures.push_back(tasks[i].result.get_future());
+        lk::thread_pool::instance().submit(g, run_promise, &tasks[i]);
+    }
+
+    // waiting on the group runs queued tasks meanwhile, which blocking on a future would not
+    g.wait();
+
+    std::vector<lk::vardata_t> results(futures.size());
+    for (size_t i = 0; i < futures.size(); i++) {
+        try {
+            results[i] = futures[i].get();
+        } catch (std::exception &e) {
+            results[i].empty_hash();
+            results[i].hash_item("error", lk_string(e.what()));
         }
+    }
+    return_results(cxt, results, result_name);
+}
 
+// calls the script function given as the second argument of parallel_map() or parallel_for() for each item
+static void call_parallel(lk::invoke_t &cxt, const char *name, const std::vector<lk::vardata_t> &items) {
+    lk::vardata_t &f = cxt.arg(1).deref();
+    if (f.type() != lk::vardata_t::INTFUNC) {
+        cxt.error(lk_string(name) + ": expected a script function");
+        return;
+    }
 
-        end = std::chrono::system_clock::now();
-        diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        add_input_time = " bytecode additional input time: " + std::to_string(diff) + "ms ";
-
-        if (cxt.result().vec()->size() > 0) return;
-
-
-//
-        start = std::chrono::system_clock::now();
-
-        lk_string lk_result = "lk_result";
-        if (cxt.arg_count() > 3)
-            lk_result = cxt.arg(3).as_string();
-
-//
-
-        // testing with vector and then will move to table or other files as inputs.
-        if (cxt.arg(2).deref().type() == lk::vardata_t::VECTOR) {
-            int num_threads = cxt.arg(2).length();
-
-            // std::async implementation - speed up of about 5.2 for 8 threads or more
-            std::vector<std::future<lk_string> > results;
-            for (i = 0; (int) i < num_threads; i++) {
-                lk::vardata_t input_value = cxt.arg(2).vec()->at(i);
-                // output
-                results.push_back(
-                        std::async(std::launch::async, async_thread, cxt, bc, lk_result, input_name, input_value));
-            }
-            // Will block till data is available in future<std::string> object.
-            for (i = 0; (int) i < num_threads; i++) {
-                cxt.result().vec_append(results[i].get());
-            }
+    if (!cxt.bc()) {
+        cxt.error(lk_string(name) + ": script functions can only be called in parallel from compiled code");
+        return;
+    }
 
-        }
-//
-        end = std::chrono::system_clock::now();
-        diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        loop_time = " loop time: " + std::to_string(diff) + "ms \n";
-        cxt.result().vec_append(file_time + loop_time);
+    std::vector<lk::vardata_t> results;
+    std::vector<lk_string> errors;
+    lk::parallel_call(cxt.bc(), f.faddr(), items, results, errors, cxt.env());
 
+    lk_string err;
+    for (size_t i = 0; i < errors.size(); i++) {
+        if (errors[i].empty())
+            continue;
+        err += lk::format("%s: error at index %d: ", name, (int) i) + errors[i];
+        if (err[err.length() - 1] != '\n')
+            err += "\n";
     }
-}
 
+    if (!err.empty()) {
+        cxt.error(err);
+        return;
+    }
 
-static void _promise(lk::invoke_t &cxt) {
-    LK_DOC("promise", "For running function in a thread using std::promise.",
-           "(string: file containg lk code to run in separate thread, string: variable to set for each separate thread, vector: arguments for variable for each thread):vector");
-    // wrapper around std::async to run functions with argument
-    // will use std::promise, std::future in combination with std::package or std::async
-    //lk_string func_name = cxt.arg(0).as_string();
+    cxt.result().empty_vector();
+    cxt.result().resize(results.size());
+    for (size_t i = 0; i < results.size(); i++)
+        cxt.result().index(i)->copy(results[i]);
+}
 
-// checking for bottlenecks
-    std::chrono::system_clock::time_point start = std::chrono::system_clock::now();
-    lk_string file_time, loop_time;
+static void _parallel_map(lk::invoke_t &cxt) {
+    LK_DOC("parallel_map",
+           "Calls a script function with each element of an array, concurrently on the thread pool, and returns the results in an array in the same order. The function sees a read-only copy of the variables visible where parallel_map is called. If any call fails, the error of each failed element is reported with its index.",
+           "(array:items, function:func):array");
 
+    lk::vardata_t &items = cxt.arg(0).deref();
+    if (items.type() != lk::vardata_t::VECTOR) {
+        cxt.error("parallel_map: expected an array");
+        return;
+    }
 
-    lk_string fn = cxt.arg(0).as_string();
-    FILE *fp = fopen(fn.c_str(), "r");
-    if (!fp)
-        cxt.result().assign("No valid input file specified");
-    else {
-        lk_string file_contents;
-        char buf[1024];
-        while (fgets(buf, 1023, fp) != 0)
-            file_contents += buf;
-        fclose(fp);
+    // a packed array is read without unpacking it
+    if (const std::vector<double> *nv = items.cnumvec()) {
+        std::vector<lk::vardata_t> list(nv->size());
+        for (size_t i = 0; i < list.size(); i++)
+            if (!lk::vardata_t::is_null_num((*nv)[i]))
+                list[i].assign((*nv)[i]);
+        call_parallel(cxt, "parallel_map", list);
+    } else
+        call_parallel(cxt, "parallel_map", *items.cvec());
+}
 
+static void _parallel_for(lk::invoke_t &cxt) {
+    LK_DOC("parallel_for",
+           "Calls a script function with each index from 0 to n-1, concurrently on the thread pool, and returns the results in an array in index order. The function sees a read-only copy of the variables visible where parallel_for is called. If any call fails, the error of each failed index is reported.",
+           "(number:n, function:func):array");
 
-//
-        auto end = std::chrono::system_clock::now();
-        auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        file_time = " File time: " + std::to_string(diff) + "ms ";
+    std::vector<lk::vardata_t> items(cxt.arg(0).as_unsigned());
+    for (size_t i = 0; i < items.size(); i++)
+        items[i].assign((double) i);
 
-//
-        start = std::chrono::system_clock::now();
-//
+    call_parallel(cxt, "parallel_for", items);
+}
 
-        // testing with vector and then will move to table or other files as inputs.
-        if (cxt.arg(2).deref().type() == lk::vardata_t::VECTOR) {
-            int num_threads = cxt.arg(2).length();
-            cxt.result().empty_vector();
+static void _thread_pool_size(lk::invoke_t &cxt) {
+    LK_DOC("thread_pool_size",
+           "Returns the number of worker threads of the pool that async(), promise(), sweep(), async_func(), parallel_map() and parallel_for() run on, first replacing them with the given number of workers if one is given, or one per processor for 0.",
+           "([number:workers]):number");
 
-            std::vector<std::future<lk_string> > results;
-            std::vector<std::thread> threads;
-
-            for (int i = 0; i < num_threads; i++) {
-                std::promise<lk_string> p;
-                auto sh = std::make_shared<std::promise<lk_string>>(std::move(p));
-                results.push_back(p.get_future());
-                lk_string lks =
-                        cxt.arg(1).as_string() + "=" + cxt.arg(2).vec()->at(i).as_string() + ";\n" + file_contents +
-                        "\n";
-                threads.push_back(std::thread(async_thread_promise, lks, sh));
-                threads[i].detach();
-            }
-            for (int i = 0; i < num_threads; i++) {
-                cxt.result().vec_append(results[i].get());
-            }
-        }
-//
-        end = std::chrono::system_clock::now();
-        diff = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
-        loop_time = " loop time: " + std::to_string(diff) + "ms \n";
-        cxt.result().vec_append(file_time + loop_time);
+    if (cxt.arg_count() > 0)
+        lk::thread_pool::instance().set_size(cxt.arg(0).as_unsigned());
 
-    }
+    cxt.result().assign((double) lk::thread_pool::instance().size());
 }
 
 
@@ -1531,7 +1336,12 @@ public:
                 out("[ ");
                 level++;
                 for (int i = 0; i < (int) x.length(); i++) {
-                    write(*x.index(i));
+                    if (const std::vector<double> *nv = x.cnumvec()) {
+                        lk::vardata_t item;
+                        if (!lk::vardata_t::is_null_num((*nv)[i])) item.assign((*nv)[i]);
+                        write(item);
+                    } else
+                        write(*x.cindex(i));
                     if (i < (int) x.length() - 1)
                         out(", ");
                 }
@@ -1544,13 +1354,13 @@ public:
                 out("{\n");
                 level++;
 
-                size_t i = 0, n = x.hash()->size();
-                for (lk::varhash_t::const_iterator it = x.hash()->begin();
-                     it != x.hash()->end();
+                size_t i = 0, n = x.chash()->size();
+                for (lk::varhash_t::const_iterator it = x.chash()->begin();
+                     it != x.chash()->end();
                      ++it) {
                     indent();
                     out("\"" + it->first + "\" : ");
-                    write(*it->second);
+                    write(it->second);
                     if (i++ < n - 1)
                         out(",\n");
                     else
@@ -1981,7 +1791,7 @@ static void _join(lk::invoke_t &cxt) {
     lk_string delim = cxt.arg(1).as_string();
     lk::vardata_t &a = cxt.arg(0);
     for (size_t i = 0; i < a.length(); i++) {
-        buf += a.index(i)->as_string();
+        buf += a.cindex(i)->as_string();
         if (i < a.length() - 1)
             buf += delim;
     }
@@ -1997,11 +1807,30 @@ static void _real_array(lk::invoke_t &cxt) {
         cxt.result().vec_append(atof((const char *) list[i].c_str()));
 }
 
-static void _ff_sum(lk::vardata_t &x, double mean, double *sum, double *sumsqr, int *nvalues) {
+/// numeric value of an array element, reading packed arrays directly
+static double _elem_num(const lk::vardata_t &arr, size_t i) {
+    if (const std::vector<double> *nv = arr.cnumvec()) {
+        double x = (*nv)[i];
+        return lk::vardata_t::is_null_num(x) ? 0.0 : x;
+    }
+    return arr.cindex(i)->as_number();
+}
+
+static void _ff_sum(const lk::vardata_t &x, double mean, double *sum, double *sumsqr, int *nvalues) {
     switch (x.type()) {
         case lk::vardata_t::VECTOR: {
-            for (size_t i = 0; i < x.length(); i++)
-                _ff_sum(*(x.index(i)), mean, sum, sumsqr, nvalues);
+            if (const std::vector<double> *nv = x.cnumvec()) {
+                for (size_t i = 0; i < nv->size(); i++) {
+                    double val = (*nv)[i];
+                    if (lk::vardata_t::is_null_num(val)) continue;
+                    (*nvalues)++;
+                    (*sum) += val;
+                    (*sumsqr) += (val - mean) * (val - mean);
+                }
+            } else {
+                for (size_t i = 0; i < x.length(); i++)
+                    _ff_sum(*(x.cindex(i)), mean, sum, sumsqr, nvalues);
+            }
         }
             break;
         case lk::vardata_t::NUMBER: {
@@ -2052,7 +1881,7 @@ static void _mmedian(lk::invoke_t &cxt) {
     else if (cxt.arg_count() == 1 && cxt.arg(0).type() == lk::vardata_t::VECTOR && cxt.arg(0).length() > 0) {
         lk::vardata_t &arr = cxt.arg(0);
         for (size_t i = 0; i < arr.length(); i++)
-            values.push_back(arr.index(i)->as_number());
+            values.push_back(_elem_num(arr, i));
     } else {
         cxt.error("invalid arguments to the min() function");
         return;
@@ -2126,9 +1955,9 @@ static void _mmin(lk::invoke_t &cxt) {
                && cxt.arg(0).type() == lk::vardata_t::VECTOR
                && cxt.arg(0).length() > 0) {
         lk::vardata_t &arr = cxt.arg(0);
-        double m = arr.index(0)->as_number();
+        double m = _elem_num(arr, 0);
         for (size_t i = 1; i < arr.length(); i++) {
-            double t = arr.index(i)->as_number();
+            double t = _elem_num(arr, i);
             if (t < m) m = t;
         }
         cxt.result().assign(m);
@@ -2150,9 +1979,9 @@ static void _mmax(lk::invoke_t &cxt) {
                && cxt.arg(0).type() == lk::vardata_t::VECTOR
                && cxt.arg(0).length() > 0) {
         lk::vardata_t &arr = cxt.arg(0);
-        double m = arr.index(0)->as_number();
+        double m = _elem_num(arr, 0);
         for (size_t i = 1; i < arr.length(); i++) {
-            double t = arr.index(i)->as_number();
+            double t = _elem_num(arr, i);
             if (t > m) m = t;
         }
         cxt.result().assign(m);
@@ -2487,7 +2316,6 @@ void _sql_exec(lk::invoke_t &cxt) {
             R.vec()->push_back(lk::vardata_t());
             lk::vardata_t &row = R.vec()->back();
             row.empty_vector();
-            row.vec()->reserve(ncol);
 
             for (int i = 0; i < ncol; i++) {
                 int type = sqlite3_column_type(stmt, i);
@@ -2520,11 +2348,9 @@ void _sql_exec(lk::invoke_t &cxt) {
                     }
                         break;
 
-                    case SQLITE_NULL: {
-                        lk::vardata_t nv;
-                        nv.nullify();
-                        row.vec()->push_back(nv);
-                    }
+                    case SQLITE_NULL:
+                        // a null element keeps an all-numeric row packed
+                        row.resize(row.length() + 1);
                         break;
                 };
             } // value column loop
@@ -2546,9 +2372,13 @@ void _sql_error(lk::invoke_t &cxt) {
 
 lk::fcall_t *lk::stdlib_thread() {
     static const lk::fcall_t vec[] = {
+            _sweep,
             _async,
             _promise,
             _async_func,
+            _parallel_map,
+            _parallel_for,
+            _thread_pool_size,
             0};
 
     return (fcall_t *) vec;
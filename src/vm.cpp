@@ -24,7 +24,15 @@
 
 #include <numeric>
 #include <limits>
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <lk/vm.h>
 
@@ -77,8 +85,628 @@ namespace lk {
             {TYP,     "typ"}, // impl
             {VEC,     "vec"},
             {HASH,    "hash"},
+            {RSREF,   "rsref"}, // impl
+            {LSREF,   "lsref"}, // impl
+            {ARGS,    "args"}, // impl
+            {TAILCALL, "tailcall"}, // impl
+            {LIDX,    "lidx"}, // impl
+            {LKEY,    "lkey"}, // impl
+            {ADDEQ,   "addeq"}, // impl
+            {SUBEQ,   "subeq"}, // impl
+            {MULEQ,   "muleq"}, // impl
+            {DIVEQ,   "diveq"}, // impl
+            {ADDN,    "addn"}, // impl
+            {SUBN,    "subn"}, // impl
+            {MULN,    "muln"}, // impl
+            {DIVN,    "divn"}, // impl
+            {LTN,     "ltn"}, // impl
+            {GTN,     "gtn"}, // impl
+            {LEN,     "len"}, // impl
+            {GEN,     "gen"}, // impl
+            {NEN,     "nen"}, // impl
+            {EQN,     "eqn"}, // impl
+            {LTJF,    "ltjf"}, // impl
+            {LEJF,    "lejf"}, // impl
+            {GTJF,    "gtjf"}, // impl
+            {GEJF,    "gejf"}, // impl
+            {EQJF,    "eqjf"}, // impl
+            {NEJF,    "nejf"}, // impl
+            {PSHADD,  "pshadd"}, // impl
+            {PSHSUB,  "pshsub"}, // impl
+            {INCL,    "incl"}, // impl
+            {DECL,    "decl"}, // impl
+            {STL,     "stl"}, // impl
+            {IDXW,    "idxw"}, // impl
+            {PSHKEY,  "pshkey"}, // impl
             {__MaxOp, 0}};
 
+    Opcode base_op(Opcode op) {
+        switch (op) {
+            case ADDN:
+                return ADD;
+            case SUBN:
+                return SUB;
+            case MULN:
+                return MUL;
+            case DIVN:
+                return DIV;
+            case LTN:
+                return LT;
+            case GTN:
+                return GT;
+            case LEN:
+                return LE;
+            case GEN:
+                return GE;
+            case NEN:
+                return NE;
+            case EQN:
+                return EQ;
+            case LTJF:
+                return LT;
+            case LEJF:
+                return LE;
+            case GTJF:
+                return GT;
+            case GEJF:
+                return GE;
+            case EQJF:
+                return EQ;
+            case NEJF:
+                return NE;
+            case PSHADD:
+            case PSHSUB:
+            case PSHKEY:
+                return PSH;
+            case INCL:
+            case DECL:
+            case STL:
+                return LSREF;
+            case IDXW:
+                return LIDX;
+            default:
+                return op;
+        }
+    }
+
+    Opcode number_op(Opcode op) {
+        switch (op) {
+            case ADD:
+                return ADDN;
+            case SUB:
+                return SUBN;
+            case MUL:
+                return MULN;
+            case DIV:
+                return DIVN;
+            case LT:
+                return LTN;
+            case GT:
+                return GTN;
+            case LE:
+                return LEN;
+            case GE:
+                return GEN;
+            case NE:
+                return NEN;
+            case EQ:
+                return EQN;
+            default:
+                return op;
+        }
+    }
+
+    size_t peephole(bytecode &b) {
+        std::vector<unsigned int> &code = b.program;
+        size_t nfused = 0;
+        for (size_t i = 0; i + 1 < code.size(); i++) {
+            // number-only instructions fuse as their base instructions do
+            Opcode op = base_op((Opcode) (unsigned char) code[i]);
+            Opcode op1 = base_op((Opcode) (unsigned char) code[i + 1]);
+            Opcode op2 = (i + 2 < code.size()) ? (Opcode) (unsigned char) code[i + 2] : __MaxOp;
+            Opcode fused = __MaxOp;
+
+            if (op1 == JF) {
+                switch (op) {
+                    case LT:
+                        fused = LTJF;
+                        break;
+                    case LE:
+                        fused = LEJF;
+                        break;
+                    case GT:
+                        fused = GTJF;
+                        break;
+                    case GE:
+                        fused = GEJF;
+                        break;
+                    case EQ:
+                        fused = EQJF;
+                        break;
+                    case NE:
+                        fused = NEJF;
+                        break;
+                    default:
+                        break;
+                }
+            } else if (op == PSH && op1 == ADD)
+                fused = PSHADD;
+            else if (op == PSH && op1 == SUB)
+                fused = PSHSUB;
+            else if (op == PSH && (op1 == KEY || op1 == LKEY))
+                fused = PSHKEY;
+            else if (op == LSREF && op2 == POP) {
+                if (op1 == INC) fused = INCL;
+                else if (op1 == DEC) fused = DECL;
+                else if (op1 == WR) fused = STL;
+            } else if (op == LIDX && op1 == WR)
+                fused = IDXW;
+
+            if (fused != __MaxOp) {
+                code[i] = (code[i] & 0xFFFFFF00) | ((unsigned int) fused & 0x000000FF);
+                nfused++;
+            }
+        }
+
+        return nfused;
+    }
+
+/// true if the instructions a superinstruction absorbed still follow it
+    static bool absorbed(const std::vector<unsigned int> &code, size_t ip, Opcode op) {
+        static const Opcode none = __MaxOp;
+        Opcode seq[2] = {none, none};
+        switch (op) {
+            case LTJF: case LEJF: case GTJF: case GEJF: case EQJF: case NEJF:
+                seq[0] = JF;
+                break;
+            case PSHADD:
+                seq[0] = ADD;
+                break;
+            case PSHSUB:
+                seq[0] = SUB;
+                break;
+            case PSHKEY:
+                seq[0] = (ip + 1 < code.size() && (Opcode) (unsigned char) code[ip + 1] == LKEY) ? LKEY : KEY;
+                break;
+            case INCL:
+                seq[0] = INC;
+                seq[1] = POP;
+                break;
+            case DECL:
+                seq[0] = DEC;
+                seq[1] = POP;
+                break;
+            case STL:
+                seq[0] = WR;
+                seq[1] = POP;
+                break;
+            case IDXW:
+                seq[0] = WR;
+                break;
+            default:
+                return true;
+        }
+
+        for (size_t k = 0; k < 2 && seq[k] != none; k++)
+            if (ip + 1 + k >= code.size() || base_op((Opcode) (unsigned char) code[ip + 1 + k]) != seq[k])
+                return false;
+        return true;
+    }
+
+    static bool verify_error(lk_string *err, size_t ip, const char *what) {
+        if (err) {
+            char buf[128];
+            sprintf(buf, "bytecode [%d]: ", (int) ip);
+            *err = lk_string(buf) + what;
+        }
+        return false;
+    }
+
+    bool verify(bytecode &b, lk_string *err) {
+        const std::vector<unsigned int> &code = b.program;
+        const size_t n = code.size();
+        b.verified = false;
+        b.max_stack = 0;
+        b.entries.assign(n, false);
+
+        // stack depth on entry to each instruction, relative to the start of the main
+        // program or of the function body it belongs to, and which of them that is
+        std::vector<int> depth(n, -1);
+        std::vector<size_t> body(n, 0);
+        std::vector<size_t> starts(1, 0), work, next;
+        size_t max_depth = 0;
+
+        for (size_t r = 0; r < starts.size(); r++) {
+            if (depth[starts[r]] >= 0)
+                return verify_error(err, starts[r], "function entered from other code");
+
+            depth[starts[r]] = 0;
+            body[starts[r]] = r;
+            work.push_back(starts[r]);
+
+            while (!work.empty()) {
+                size_t ip = work.back();
+                work.pop_back();
+
+                Opcode op = (Opcode) (unsigned char) code[ip];
+                size_t arg = code[ip] >> 8;
+                if (op >= __MaxOp)
+                    return verify_error(err, ip, "invalid instruction");
+                if (!absorbed(code, ip, op))
+                    return verify_error(err, ip, "incomplete superinstruction");
+
+                // values the instruction needs on the stack, how many it leaves in their place,
+                // the identifier it names if any, and where execution may continue
+                size_t need = 0, leave = 0;
+                size_t iden = 0;
+                bool named = false;
+                next.assign(1, ip + 1);
+
+                switch (base_op(op)) {
+                    case ADD: case SUB: case MUL: case DIV: case LT: case GT: case LE: case GE: case NE:
+                    case EQ: case OR: case AND: case EXP: case IDX: case KEY: case LIDX: case LKEY:
+                    case MAT: case WAT: case WR: case ADDEQ: case SUBEQ: case MULEQ: case DIVEQ:
+                        need = 2;
+                        leave = 1;
+                        break;
+                    case INC: case DEC: case NOT: case NEG: case SZ: case KEYS:
+                        need = leave = 1;
+                        break;
+                    case POP:
+                        need = 1;
+                        break;
+                    case DUP:
+                        need = 1;
+                        leave = 2;
+                        break;
+                    case NUL:
+                        leave = 1;
+                        break;
+                    case PSH:
+                        if (arg >= b.constants.size())
+                            return verify_error(err, ip, "invalid constant");
+                        leave = 1;
+                        break;
+                    case RREF: case LREF: case LCREF: case LGREF: case GET: case TYP:
+                        iden = arg;
+                        named = true;
+                        leave = 1;
+                        break;
+                    case RSREF: case LSREF:
+                        iden = slot_identifier(arg);
+                        named = true;
+                        leave = 1;
+                        break;
+                    case ARG:
+                        iden = arg;
+                        named = true;
+                        break;
+                    case SET:
+                        iden = arg;
+                        named = true;
+                        need = 1;
+                        break;
+                    case ARGS:
+                        break;
+                    case FREF:
+                        if (arg >= n)
+                            return verify_error(err, ip, "invalid function address");
+                        if (!b.entries[arg]) {
+                            b.entries[arg] = true;
+                            starts.push_back(arg);
+                        }
+                        leave = 1;
+                        break;
+                    case CALL: case TAILCALL:
+                        need = arg + 2;
+                        leave = 1;
+                        break;
+                    case TCALL:
+                        // the object called on is dropped along with the function
+                        need = arg + 3;
+                        leave = 1;
+                        break;
+                    case VEC:
+                        need = arg;
+                        leave = 1;
+                        break;
+                    case HASH:
+                        need = arg * 2;
+                        leave = 1;
+                        break;
+                    case SWI:
+                        // followed by one jump per option
+                        need = 1;
+                        next.clear();
+                        for (size_t k = 1; k <= arg; k++)
+                            next.push_back(ip + k);
+                        break;
+                    case J:
+                        next[0] = arg;
+                        break;
+                    case JF: case JT:
+                        need = 1;
+                        next.push_back(arg);
+                        break;
+                    case RET:
+                        // a function must leave exactly its return value, the caller relies on it
+                        if (r > 0 && depth[ip] != (int) arg)
+                            return verify_error(err, ip, "unbalanced stack on return");
+                        next.clear();
+                        break;
+                    case END:
+                        next.clear();
+                        break;
+                    default:
+                        return verify_error(err, ip, "invalid instruction");
+                }
+
+                if (named && iden >= b.identifiers.size())
+                    return verify_error(err, ip, "invalid identifier");
+                if ((size_t) depth[ip] < need)
+                    return verify_error(err, ip, "stack underflow");
+
+                int d = depth[ip] - (int) need + (int) leave;
+                max_depth = std::max(max_depth, (size_t) d);
+
+                for (size_t k = 0; k < next.size(); k++) {
+                    size_t to = next[k];
+                    if (to > n)
+                        return verify_error(err, ip, "jump out of program");
+                    if (to == n)
+                        continue; // stops the program, like running off the end
+
+                    if (depth[to] < 0) {
+                        depth[to] = d;
+                        body[to] = r;
+                        work.push_back(to);
+                    } else if (depth[to] != d || body[to] != r)
+                        return verify_error(err, ip, "inconsistent stack depth");
+                }
+            }
+        }
+
+        b.max_stack = max_depth;
+        b.verified = true;
+        return true;
+    }
+
+/// entries between saved decoder states in a linetable
+    static const size_t LINETABLE_CHECKPOINT = 16;
+
+    static void put_varint(std::vector<unsigned char> &data, size_t v) {
+        while (v >= 0x80) {
+            data.push_back((unsigned char) (v | 0x80));
+            v >>= 7;
+        }
+        data.push_back((unsigned char) v);
+    }
+
+    static size_t get_varint(const std::vector<unsigned char> &data, size_t &offset) {
+        size_t v = 0;
+        for (int shift = 0; offset < data.size(); shift += 7) {
+            unsigned char b = data[offset++];
+            v |= ((size_t) (b & 0x7F)) << shift;
+            if (!(b & 0x80)) break;
+        }
+        return v;
+    }
+
+/// signed deltas are stored zigzag encoded so small negative values stay short
+    static void put_delta(std::vector<unsigned char> &data, long d) {
+        put_varint(data, (size_t) (((unsigned long) d << 1) ^ (unsigned long) (d >> (sizeof(long) * 8 - 1))));
+    }
+
+    static long get_delta(const std::vector<unsigned char> &data, size_t &offset) {
+        size_t v = get_varint(data, offset);
+        return (long) (v >> 1) ^ -(long) (v & 1);
+    }
+
+    void linetable::clear() {
+        m_data.clear();
+        m_index.clear();
+        m_files.clear();
+        m_size = m_count = 0;
+        m_last.begin = m_last.end = m_last.next = 0;
+        m_last.line = m_last.stmt = m_last.stmt_end = 0;
+        m_last.file = 0;
+    }
+
+    void linetable::push_back(const srcpos_t &pos) {
+        if (m_count > 0
+            && pos.line == m_last.line && pos.stmt == m_last.stmt && pos.stmt_end == m_last.stmt_end
+            && pos.file == m_files[m_last.file]) {
+            m_size++;
+            return;
+        }
+
+        size_t f = 0;
+        while (f < m_files.size() && m_files[f] != pos.file)
+            f++;
+        if (f == m_files.size())
+            m_files.push_back(pos.file);
+
+        if (m_count % LINETABLE_CHECKPOINT == 0) {
+            checkpoint c;
+            c.offset = m_data.size();
+            c.begin = m_size;
+            c.prev = m_last;
+            m_index.push_back(c);
+        }
+
+        put_varint(m_data, m_size - m_last.begin);
+        put_delta(m_data, (long) pos.line - m_last.line);
+        put_delta(m_data, (long) pos.stmt - m_last.stmt);
+        put_delta(m_data, (long) pos.stmt_end - m_last.stmt_end);
+        put_delta(m_data, (long) f - (long) m_last.file);
+
+        m_last.begin = m_size;
+        m_last.line = pos.line;
+        m_last.stmt = pos.stmt;
+        m_last.stmt_end = pos.stmt_end;
+        m_last.file = f;
+        m_count++;
+        m_size++;
+    }
+
+    bool linetable::decode(size_t offset, const entry &prev, entry &e) const {
+        if (offset >= m_data.size())
+            return false;
+
+        e.begin = prev.begin + get_varint(m_data, offset);
+        e.line = prev.line + (int) get_delta(m_data, offset);
+        e.stmt = prev.stmt + (int) get_delta(m_data, offset);
+        e.stmt_end = prev.stmt_end + (int) get_delta(m_data, offset);
+        e.file = (size_t) ((long) prev.file + get_delta(m_data, offset));
+        e.next = offset;
+
+        // an entry ends where the next one begins
+        if (offset < m_data.size())
+            e.end = e.begin + get_varint(m_data, offset);
+        else
+            e.end = m_size;
+
+        return true;
+    }
+
+    bool linetable::first(entry &e) const {
+        return m_index.size() > 0 && decode(0, m_index[0].prev, e);
+    }
+
+    bool linetable::next(entry &e) const {
+        entry prev = e;
+        return decode(prev.next, prev, e);
+    }
+
+    bool linetable::lookup(size_t ip, entry &e) const {
+        if (ip >= m_size || m_index.empty())
+            return false;
+
+        // last saved state at or before ip
+        size_t lo = 0, hi = m_index.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (m_index[mid].begin <= ip)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        if (!decode(m_index[lo].offset, m_index[lo].prev, e))
+            return false;
+
+        while (e.end <= ip)
+            if (!next(e))
+                return false;
+
+        return true;
+    }
+
+    srcpos_t linetable::at(size_t ip) const {
+        entry e;
+        if (!lookup(ip, e))
+            return srcpos_t::npos;
+
+        return srcpos_t(m_files[e.file], e.line, e.stmt, e.stmt_end);
+    }
+
+    int linetable::find_file(const lk_string &name) const {
+        for (size_t i = 0; i < m_files.size(); i++)
+            if (m_files[i] == name)
+                return (int) i;
+        return -1;
+    }
+
+    bool linetable::assign(const unsigned char *data, size_t len, const std::vector<lk_string> &files, size_t size) {
+        clear();
+        m_data.assign(data, data + len);
+        m_files = files;
+        m_size = size;
+
+        // decode every entry once to validate it and to rebuild the saved decoder states
+        entry prev = m_last;
+        size_t offset = 0;
+        while (offset < m_data.size()) {
+            entry e;
+            decode(offset, prev, e);
+            if (e.file >= m_files.size() || e.begin >= m_size || e.end > m_size
+                || (m_count > 0 && e.begin <= prev.begin) || e.next <= offset) {
+                clear();
+                return false;
+            }
+
+            if (m_count % LINETABLE_CHECKPOINT == 0) {
+                checkpoint c;
+                c.offset = offset;
+                c.begin = e.begin;
+                c.prev = prev;
+                m_index.push_back(c);
+            }
+
+            m_count++;
+            offset = e.next;
+            prev = e;
+        }
+
+        if (m_count == 0 && m_size > 0) {
+            clear();
+            return false;
+        }
+
+        m_last = prev;
+        return true;
+    }
+
+/// evaluates one of the comparison instructions with the same semantics as its handler
+    static bool compare(Opcode op, vardata_t &lhs, vardata_t &rhs) {
+        switch (op) {
+            case LT:
+                return lhs.lessthan(rhs);
+            case LE:
+                return lhs.lessthan(rhs) || lhs.equals(rhs);
+            case GT:
+                return !lhs.lessthan(rhs) && !lhs.equals(rhs);
+            case GE:
+                return !lhs.lessthan(rhs);
+            case EQ:
+                return lhs.equals(rhs);
+            case NE:
+                return !lhs.equals(rhs);
+            default:
+                return false;
+        }
+    }
+
+/// compare() for two numbers, where NaN is neither less than nor equal to anything
+    static inline bool compare_num(Opcode op, double lhs, double rhs) {
+        switch (op) {
+            case LT:
+                return lhs < rhs;
+            case LE:
+                return lhs < rhs || lhs == rhs;
+            case GT:
+                return !(lhs < rhs) && !(lhs == rhs);
+            case GE:
+                return !(lhs < rhs);
+            case EQ:
+                return lhs == rhs;
+            case NE:
+                return !(lhs == rhs);
+            default:
+                return false;
+        }
+    }
+
+/// the array or switch index held by a value.  whole numbers in range, the usual case,
+/// convert directly rather than through as_unsigned()
+    static inline size_t index_of(const vardata_t &x) {
+        if (x.type() == vardata_t::NUMBER) {
+            double d = x.num_value();
+            if (d >= 0.0 && d < 4294967296.0) return (size_t) d;
+        }
+        return x.as_unsigned();
+    }
+
 #ifdef OP_PROFILE
 
 /// resets operation count
@@ -89,11 +717,20 @@ namespace lk {
 
 #endif
 
-/// initializes a vm with a stack of given size
+/// default for the most entries the stack may grow to
+    static const size_t DEFAULT_MAX_STACK = 1048576;
+
+/// initializes a vm with a stack of given initial size
     vm::vm(size_t ssize) {
         bc = 0;
         ip = sp = 0;
+        brkstmt = -1;
+        brkfile = (size_t) -1;
+        curentry.begin = curentry.end = 0;
         stack.resize(ssize, vardata_t());
+        maxstack = std::max(ssize, DEFAULT_MAX_STACK);
+        maxdepth = 0;
+        unverified_call = false;
         frames.reserve(16);
 
 #ifdef OP_PROFILE
@@ -112,6 +749,72 @@ namespace lk {
 
     vm::~vm() {
         free_frames();
+
+        for (size_t i = 0; i < framepool.size(); i++)
+            delete framepool[i];
+
+        for (size_t i = 0; i < varpool.size(); i++)
+            delete varpool[i];
+    }
+
+    void vm::set_limits(size_t max_stack, size_t max_depth) {
+        maxstack = std::max(max_stack, stack.size());
+        maxdepth = max_depth;
+    }
+
+/// grows the stack until it has room for n more entries
+    bool vm::reserve_stack(size_t n) {
+        while ((size_t) sp + n > stack.size())
+            if (!grow_stack())
+                return false;
+        return true;
+    }
+
+/// doubles the stack, up to the limit.  entries can refer to one another and arguments are bound
+/// to their stack entries, so references into the old storage are moved over to the new one
+    bool vm::grow_stack() {
+        size_t n = std::min(std::max(stack.size() * 2, (size_t) 16), maxstack);
+        if (n <= stack.size())
+            return false;
+
+        std::vector<vardata_t> grown(n);
+        for (size_t i = 0; i < stack.size(); i++)
+            grown[i].copy(stack[i]);
+
+        const vardata_t *lo = &stack[0], *hi = &stack[0] + stack.size();
+#define REBASE(p) (&grown[0] + ((p) - lo))
+
+        for (size_t i = 0; i < stack.size(); i++)
+            if (vardata_t *r = grown[i].ref())
+                if (r >= lo && r < hi)
+                    grown[i].assign(REBASE(r));
+
+        for (size_t i = 0; i < frames.size(); i++) {
+            frame &F = *frames[i];
+            lk_string name;
+            vardata_t *x;
+            bool more = F.env.first(name, x);
+            while (more) {
+                if (vardata_t *r = x->ref())
+                    if (r >= lo && r < hi)
+                        x->assign(REBASE(r));
+                more = F.env.next(name, x);
+            }
+
+            for (size_t k = 0; k < F.retired.size(); k++)
+                if (vardata_t *r = F.retired[k]->ref())
+                    if (r >= lo && r < hi)
+                        F.retired[k]->assign(REBASE(r));
+        }
+
+        for (size_t i = 0; i < elemargs.size(); i++)
+            if (elemargs[i].arr >= lo && elemargs[i].arr < hi)
+                elemargs[i].arr = REBASE(elemargs[i].arr);
+
+#undef REBASE
+
+        stack.swap(grown);
+        return true;
     }
 
     bool vm::on_run(const srcpos_t &) {
@@ -120,12 +823,207 @@ namespace lk {
 
 /// deletes all frames
     void vm::free_frames() {
-        for (size_t i = 0; i < frames.size(); i++)
+        for (size_t i = 0; i < frames.size(); i++) {
+            for (size_t k = 0; k < frames[i]->retired.size(); k++)
+                delete frames[i]->retired[k];
             delete frames[i];
+        }
         frames.clear();
     }
 
+/// source position of an instruction.  the entry it came from is kept, so looking up the
+/// following instructions of the same statement costs a comparison
+    const srcpos_t &vm::position(size_t addr) {
+        if (addr >= curentry.begin && addr < curentry.end)
+            return curpos;
+
+        size_t file = curentry.file;
+        bool known = curentry.end > 0;
+        if (!bc || !bc->debuginfo.lookup(addr, curentry)) {
+            curentry.begin = curentry.end = 0;
+            return srcpos_t::npos;
+        }
+
+        curpos.line = curentry.line;
+        curpos.stmt = curentry.stmt;
+        curpos.stmt_end = curentry.stmt_end;
+        if (!known || file != curentry.file)
+            curpos.file = bc->debuginfo.file(curentry.file);
+
+        return curpos;
+    }
+
+/// a variable for a frame's environment, recycled from returned frames when possible
+    vardata_t *vm::new_var() {
+        if (varpool.empty())
+            return new vardata_t;
+
+        vardata_t *x = varpool.back();
+        varpool.pop_back();
+        return x;
+    }
+
+/// clears a variable no longer in any frame and keeps it for reuse
+    void vm::recycle_var(vardata_t *x) {
+        x->nullify();
+        x->clear_flag(vardata_t::ASSIGNED);
+        x->clear_flag(vardata_t::CONSTVAL);
+        x->clear_flag(vardata_t::GLOBALVAL);
+        varpool.push_back(x);
+    }
+
+/// a value as a string, without copying one that already is a string
+    static inline const lk_string &string_of(const vardata_t &v, lk_string &buf) {
+        if (v.type() == vardata_t::STRING) return v.str();
+        return buf = v.as_string();
+    }
+
+/// replaces a container on the stack, or a reference to it, with a copy of one of its elements
+    static inline void load_element(vardata_t &top, const vardata_t &x) {
+        if (top.type() == vardata_t::REFERENCE) {
+            top.copy(x.deref());
+        } else {
+            // the element lives in the container being replaced
+            vardata_t temp;
+            temp.copy(x.deref());
+            top.copy(temp);
+        }
+    }
+
+/// whether the target of an assignment, pushed by the instruction before ip, is a variable itself
+/// rather than an element or a variable referring to one: only those can lie inside the value
+    static inline bool assigns_variable(const bytecode *bc, size_t ip, const vardata_t &target) {
+        if (ip == 0 || target.type() != vardata_t::REFERENCE || target.ref()->type() == vardata_t::REFERENCE)
+            return false;
+
+        Opcode prev = base_op((Opcode) (unsigned char) bc->program[ip - 1]);
+        return prev == LREF || prev == LCREF || prev == LGREF || prev == LSREF;
+    }
+
+    static void concat(vardata_t &result, const vardata_t &lhs, const vardata_t &rhs) {
+        lk_string buf1, buf2;
+        result.assign(string_of(lhs, buf1) + string_of(rhs, buf2));
+    }
+
+    static bool is_inherited(const vm::frame &F, const vardata_t *x) {
+        return !F.inherited.empty() && std::find(F.inherited.begin(), F.inherited.end(), x) != F.inherited.end();
+    }
+
+/// assigns a variable in the frame.  one inherited through a tail call is retired rather than deleted,
+/// since arguments of the call that replaced its function may still refer to it
+    void vm::bind_local(frame &F, const lk_string &name, vardata_t *x) {
+        if (!F.inherited.empty()) {
+            vardata_t *old = F.env.lookup(name, false);
+            std::vector<vardata_t *>::iterator it = std::find(F.inherited.begin(), F.inherited.end(), old);
+            if (old && it != F.inherited.end()) {
+                F.inherited.erase(it);
+                F.retired.push_back(F.env.detach(name));
+            }
+        }
+
+        F.env.assign(name, x);
+    }
+
+/// reuses the current frame for a call in return position, so that recursion through tail calls runs
+/// in constant stack and frame memory.  the callee takes over the stack slots of the returning function,
+/// whose variables stay in the frame environment: LK scopes dynamically, and the callee would have seen
+/// them in its parent frame.  references into the released slots are resolved first.  returns false,
+/// changing nothing, if the released storage holds an array or table an argument may refer into.
+    bool vm::tail_call(size_t nargs) {
+        frame &F = *frames.back();
+        size_t base = F.fp - F.nargs - (F.thiscall ? 2 : 1);
+        size_t first = sp - nargs - 1;
+        const vardata_t *lo = &stack[0] + base, *hi = &stack[0] + sp;
+
+#define RELEASED(p) (((p) >= lo && (p) < hi) || std::find(F.retired.begin(), F.retired.end(), (p)) != F.retired.end())
+
+        bool containers = false;
+        for (size_t i = base; i < (size_t) sp && !containers; i++)
+            containers = (stack[i].type() == vardata_t::VECTOR || stack[i].type() == vardata_t::HASH);
+        for (size_t i = 0; i < F.retired.size() && !containers; i++)
+            containers = (F.retired[i]->type() == vardata_t::VECTOR || F.retired[i]->type() == vardata_t::HASH);
+
+        if (containers) {
+            for (size_t i = first; i < first + nargs; i++) {
+                const vardata_t *v = &stack[i];
+                while (v->type() == vardata_t::REFERENCE && RELEASED(v->ref()))
+                    v = v->ref();
+                if (v->type() == vardata_t::REFERENCE)
+                    return false;
+            }
+        }
+
+        for (size_t i = first; i < first + nargs; i++)
+            while (stack[i].type() == vardata_t::REFERENCE && RELEASED(stack[i].ref()))
+                stack[i].copy(*stack[i].ref());
+
+        lk_string name;
+        vardata_t *x;
+        bool more = F.env.first(name, x);
+        while (more) {
+            while (x->type() == vardata_t::REFERENCE && RELEASED(x->ref()))
+                x->copy(*x->ref());
+            more = F.env.next(name, x);
+        }
+
+#undef RELEASED
+
+        for (size_t i = 0; i < F.retired.size(); i++)
+            recycle_var(F.retired[i]);
+        F.retired.clear();
+
+        for (size_t i = 0; i < nargs; i++)
+            stack[base + i].copy(stack[first + i]);
+        for (size_t i = base + nargs; i < (size_t) sp; i++)
+            stack[i].nullify();
+
+        sp = (int) (base + nargs + 1);
+        F.fp = sp;
+        F.nargs = nargs;
+        F.iarg = 0;
+        F.thiscall = false;
+        F.callip = ip;
+        F.id.clear();
+        std::fill(F.slots.begin(), F.slots.end(), (vardata_t *) 0);
+
+        F.inherited.clear();
+        more = F.env.first(name, x);
+        while (more) {
+            F.inherited.push_back(x);
+            more = F.env.next(name, x);
+        }
+
+        return true;
+    }
+
+/// names the function a frame was called as, from the instructions preceding its call
+    lk_string vm::frame_id(const frame &F) {
+        size_t cip = F.callip;
+        if (F.thiscall) {
+            if (cip > 2 && PSH == base_op((Opcode) (unsigned char) bc->program[cip - 2]))
+                return "->" + bc->constants[bc->program[cip - 2] >> 8].as_string();
+            else if (F.fp >= 2)
+                return "->" + stack[F.fp - 2].as_string();
+            else
+                return "->???";
+        }
+
+        Opcode op_tmp = (cip > 1) ? (Opcode) (unsigned char) bc->program[cip - 1] : __MaxOp;
+        size_t arg_tmp = (cip > 1) ? (bc->program[cip - 1] >> 8) : 0;
+        if (RREF == op_tmp)
+            return bc->identifiers[arg_tmp];
+        else if (RSREF == op_tmp)
+            return bc->identifiers[slot_identifier(arg_tmp)];
+        else
+            return "???";
+    }
+
+/// the id of each frame is only worked out here, calls don't spend time naming themselves
     vm::frame **vm::get_frames(size_t *nfrm) {
+        for (size_t i = 1; i < frames.size(); i++)
+            if (frames[i]->id.empty())
+                frames[i]->id = frame_id(*frames[i]);
+
         *nfrm = frames.size();
         if (frames.size() > 0) return &frames[0];
         else return 0;
@@ -137,9 +1035,13 @@ namespace lk {
     }
 
 /// sets bytecode pointer to b and deletes any created frames
-    void vm::load(bytecode *b) {
+    void vm::load(const bytecode *b) {
         bc = b;
+        curentry.begin = curentry.end = 0;
         free_frames();
+
+        // cached key positions stay valid for the same bytecode, however many times it runs
+        keycaches.assign(b ? b->program.size() : 0, keycache());
     }
 
     bool vm::special_set(const lk_string &name, vardata_t &) {
@@ -164,107 +1066,269 @@ namespace lk {
             return false;
         }
 
+        // the stack has only grown as far as earlier runs used it
         ip = sp = 0;
         for (size_t i = 0; i < stack.size(); i++)
             stack[i].nullify();
 
+        elemargs.clear();
+
         frames.push_back(new frame(env, 0, 0, 0));
 
         brkpt.resize(bc->program.size(), false);
 
         // initialize to no valid break position
-        lastbrk.line = -1;
-        lastbrk.stmt = -1;
-        lastbrk.file.clear();
+        brkstmt = -1;
+        brkfile = (size_t) -1;
+        curentry.begin = curentry.end = 0;
         return true;
     }
 
-#define CHECK_FOR_ARGS(n) if ( sp < (int)(n) ) return error( (const char*)lk_tr("stack [sp=%d] error, %d arguments required").c_str(), sp, n );
-#define CHECK_OVERFLOW() if ( sp >= (int)stack.size() ) return error( (const char*)lk_tr("stack overflow [sp=%d]").c_str(), stack.size())
-#define CHECK_CONSTANT() if ( arg >= bc->constants.size() ) return error( (const char*)lk_tr("invalid constant value address: %d\n").c_str(), arg )
-#define CHECK_IDENTIFIER() if ( arg >= bc->identifiers.size() ) return error( (const char*)lk_tr("invalid identifier address: %d\n").c_str(), arg )
+// verified bytecode cannot fail these, see verify()
+#define CHECK_FOR_ARGS(n) if ( !verified && sp < (int)(n) ) return error( (const char*)lk_tr("stack [sp=%d] error, %d arguments required").c_str(), sp, n );
+#define CHECK_OVERFLOW() if ( !verified && sp >= (int)stack.size() && !grow_stack() ) return error( (const char*)lk_tr("stack overflow [sp=%d]").c_str(), stack.size())
+#define CHECK_CONSTANT() if ( !verified && arg >= bc->constants.size() ) return error( (const char*)lk_tr("invalid constant value address: %d\n").c_str(), arg )
+#define CHECK_IDENTIFIER() if ( !verified && arg >= bc->identifiers.size() ) return error( (const char*)lk_tr("invalid identifier address: %d\n").c_str(), arg )
+
+// labels as values let the NORMAL loop jump from one handler directly to the next
+#if defined(__GNUC__) || defined(__clang__)
+#define LK_COMPUTED_GOTO 1
+#endif
+
+#ifdef LK_COMPUTED_GOTO
+#define TARGET(x) case x: L_##x
+#else
+#define TARGET(x) case x
+#endif
+
+#define FETCH_OP() op = (Opcode) (unsigned char) bc->program[ip]; arg = (bc->program[ip] >> 8); next_ip = ip + 1
+
+#ifdef OP_PROFILE
+/// an invalid opcode, which only bytecode not made by codegen can hold, is not counted
+#define PROFILE_OP() if (op < __MaxOp) opcount[op]++
+#else
+#define PROFILE_OP()
+#endif
+
+/// runs the base instruction of a superinstruction when its fast path does not apply
+#define DISPATCH_BASE() { op = base_op(op); goto redispatch; }
+
+/// ends an instruction handler: the checked loop returns to the loop tail, the
+/// NORMAL loop fetches the next instruction and dispatches it from here.  a computed
+/// goto does not run destructors, so locals such as strings must be out of scope
+#ifdef LK_COMPUTED_GOTO
+#define NEXT_OP { if (checked) break; ip = next_ip; if (ip < code_size && --budget != 0) { FETCH_OP(); PROFILE_OP(); goto *labels[op < __MaxOp ? op : __MaxOp]; } continue; }
+#else
+#define NEXT_OP break
+#endif
+
+/// verified code reserves the stack a function body may use on entering it, and leaves the
+/// fast path for a function the verifier has not seen, such as one defined by other bytecode
+#define ENTER_FUNCTION(addr) if (verified) { \
+        if ((addr) >= bc->entries.size() || !bc->entries[addr]) { ip = (addr); unverified_call = true; return true; } \
+        if (!reserve_stack(bc->max_stack)) return error( (const char*)lk_tr("stack overflow [sp=%d]").c_str(), sp ); }
+
+/// number of instructions executed in NORMAL mode between calls to on_run()
+#define POLL_INTERVAL 1024
 
     bool vm::run(ExecMode mode) {
         if (!bc || bc->program.size() == 0) return error((const char *) lk_tr("no bytecode loaded").c_str());
         if (frames.size() == 0)
             return error((const char *) lk_tr("vm not initialized").c_str()); // must initialize first.
 
-        vardata_t nullval;
+        if (mode != NORMAL)
+            return exec<true, false>(mode);
+
+        if (bc->verified) {
+            unverified_call = false;
+            bool ok = exec<false, true>(mode);
+            // a call into code the verifier has not seen continues on the checked path
+            if (!ok || !unverified_call)
+                return ok;
+        }
+
+        return exec<false, false>(mode);
+    }
+
+    bool vm::call(size_t faddr, const std::vector<vardata_t> &args, vardata_t &result) {
+        if (!bc || faddr >= bc->program.size()
+            || (bc->verified && (faddr >= bc->entries.size() || !bc->entries[faddr])))
+            return error((const char *) lk_tr("invalid function address %d").c_str(), (int) faddr);
+        if (frames.size() == 0)
+            return error((const char *) lk_tr("vm not initialized").c_str());
+
+        // lay out the stack as CALL does, with the return value below the arguments and the
+        // function, and return past the end of the program so that run() stops there
+        sp = 0;
+        if (!reserve_stack(args.size() + 2))
+            return error((const char *) lk_tr("stack overflow [sp=%d]").c_str(), sp);
+
+        stack[sp++].nullify();
+        for (size_t i = 0; i < args.size(); i++)
+            stack[sp++].copy(args[i]);
+        stack[sp++].assign_faddr(faddr);
+
+        frames.push_back(new frame(&frames.back()->env, sp, bc->program.size(), args.size(), ip));
+        ip = faddr;
+        if (!run())
+            return false;
+
+        // values left by expression statements shift where RET puts the result, which is on top
+        result.copy(stack[sp - 1].deref());
+        return true;
+    }
+
+/// the instruction loop, instantiated once with all debugging checks for DEBUG, STEP and SINGLE
+/// modes, and twice without them for NORMAL mode, where breakpoints are ignored and the user
+/// interrupt callback is only polled every POLL_INTERVAL instructions.  for verified bytecode
+/// the NORMAL loop also leaves out the stack and operand checks
+    template<bool checked, bool verified>
+    bool vm::exec(ExecMode mode) {
         size_t nexecuted = 0;
+        size_t budget = POLL_INTERVAL;
         const size_t code_size = bc->program.size();
         size_t next_ip = code_size;
-        vardata_t *lhs, *rhs;
+        Opcode op = END;
+        size_t arg = 0;
+
+#ifdef LK_COMPUTED_GOTO
+        // must follow the order of enum Opcode, with the last entry catching invalid instructions
+        static void *const labels[] = {
+                &&L_ADD, &&L_SUB, &&L_MUL, &&L_DIV, &&L_LT, &&L_GT, &&L_LE, &&L_GE, &&L_NE, &&L_EQ,
+                &&L_INC, &&L_DEC, &&L_OR, &&L_AND, &&L_NOT, &&L_NEG, &&L_EXP, &&L_PSH, &&L_POP,
+                &&L_DUP, &&L_NUL, &&L_ARG, &&L_SWI, &&L_J, &&L_JF, &&L_JT, &&L_IDX, &&L_KEY,
+                &&L_MAT, &&L_WAT, &&L_SET, &&L_GET, &&L_WR, &&L_RREF, &&L_LREF, &&L_LCREF,
+                &&L_LGREF, &&L_FREF, &&L_CALL, &&L_TCALL, &&L_RET, &&L_END, &&L_SZ, &&L_KEYS,
+                &&L_TYP, &&L_VEC, &&L_HASH, &&L_RSREF, &&L_LSREF, &&L_ARGS, &&L_TAILCALL,
+                &&L_LIDX, &&L_LKEY, &&L_ADDEQ, &&L_SUBEQ, &&L_MULEQ, &&L_DIVEQ,
+                &&L_ADDN, &&L_SUBN, &&L_MULN, &&L_DIVN, &&L_LTN, &&L_GTN, &&L_LEN, &&L_GEN, &&L_NEN, &&L_EQN,
+                &&L_LTJF, &&L_LEJF, &&L_GTJF, &&L_GEJF, &&L_EQJF, &&L_NEJF,
+                &&L_PSHADD, &&L_PSHSUB, &&L_INCL, &&L_DECL, &&L_STL, &&L_IDXW, &&L_PSHKEY,
+                &&L_invalid};
+        static_assert(sizeof(labels) / sizeof(labels[0]) == __MaxOp + 1, "dispatch table out of sync with Opcode");
+#endif
 
         // environment where all 'global' variables go
         env_t &globals = frames.front()->env;
 
         // initialize the last code point for debugging
-        if (ip < bc->debuginfo.size())
-            lastbrk = bc->debuginfo[ip];
+        if (checked && ip < bc->debuginfo.size()) {
+            brkstmt = position(ip).stmt;
+            brkfile = curentry.file;
+        }
+
+        // the rest of the stack the current function body may use, see ENTER_FUNCTION()
+        if (verified && !reserve_stack(bc->max_stack))
+            return error((const char *) lk_tr("stack overflow [sp=%d]").c_str(), sp);
 
         try {
             while (ip < code_size) {
-                Opcode op = (Opcode) (unsigned char) bc->program[ip];
-                size_t arg = (bc->program[ip] >> 8);
-
-#ifdef OP_PROFILE
-                opcount[op]++;
-#endif
-
-                if (mode != NORMAL && ip < bc->debuginfo.size() && ip < brkpt.size()) {
-                    const srcpos_t &di = bc->debuginfo[ip];
-                    if (mode == DEBUG) {
-                        if (brkpt[ip] && (nexecuted > 0 || ip == 0))
+                FETCH_OP();
+                PROFILE_OP();
+
+                if (checked) {
+                    const srcpos_t &spos = position(ip);
+
+                    if (mode != NORMAL && ip < bc->debuginfo.size() && ip < brkpt.size()) {
+                        if (mode == DEBUG) {
+                            if (brkpt[ip] && (nexecuted > 0 || ip == 0))
+                                return true;
+                        } else if (mode == STEP
+                                   && spos.stmt != brkstmt
+                                   && curentry.file == brkfile) {
                             return true;
-                    } else if (mode == STEP
-                               && di.stmt != lastbrk.stmt
-                               && di.file == lastbrk.file) {
-                        return true;
+                        }
                     }
-                }
 
-                const srcpos_t &spos = (ip < bc->debuginfo.size()) ? bc->debuginfo[ip] : srcpos_t::npos;
+                    // expression & (constant-1) is equivalent to expression % constant where
+                    // constant is a power of two: so use bitwise operator for better performance
+                    // see https://en.wikipedia.org/wiki/Modulo_operation#Performance_issues
+                    if ((nexecuted & 7) && !on_run(spos))
+                        return error((const char *) lk_tr("halted by user after %d ops").c_str(), nexecuted);
+
+                    if (sp < 0) throw error_t(lk_tr("stack corruption"));
+
+                    // debugging runs the unfused program so that every instruction is visited
+                    op = base_op(op);
+                } else if (budget == 0) {
+                    budget = POLL_INTERVAL;
+                    nexecuted += POLL_INTERVAL;
+                    if (!on_run(position(ip)))
+                        return error((const char *) lk_tr("halted by user after %d ops").c_str(), nexecuted);
+                }
 
-                // expression & (constant-1) is equivalent to expression % constant where
-                // constant is a power of two: so use bitwise operator for better performance
-                // see https://en.wikipedia.org/wiki/Modulo_operation#Performance_issues
-                if ((nexecuted & 7) && !on_run(spos))
-                    return error((const char *) lk_tr("halted by user after %d ops").c_str(), nexecuted);
+                redispatch:
+#ifdef LK_COMPUTED_GOTO
+                if (!checked)
+                    goto *labels[op < __MaxOp ? op : __MaxOp];
+#endif
 
-                next_ip = ip + 1;
+                switch (op) {
+                    TARGET(RREF):
+                    TARGET(LREF):
+                    TARGET(LCREF):
+                    TARGET(LGREF):
+                    TARGET(RSREF):
+                    TARGET(LSREF): {
+                        frame &F = *frames.back();
+                        CHECK_OVERFLOW();
 
-                if (sp < 0) throw error_t(lk_tr("stack corruption"));
+                        size_t islot = 0;
+                        bool slotted = (op == RSREF || op == LSREF);
+                        if (slotted) {
+                            // drop all bindings if a variable may have been deleted from the frame
+                            if (F.slotrev != F.env.revision()) {
+                                std::fill(F.slots.begin(), F.slots.end(), (vardata_t *) 0);
+                                F.slotrev = F.env.revision();
+                            }
 
-                rhs = (sp >= 1) ? &stack[sp - 1] : NULL;
-                lhs = (sp >= 2) ? &stack[sp - 2] : NULL;
+                            islot = slot_index(arg);
+                            if (islot < F.slots.size() && F.slots[islot] != 0) {
+                                stack[sp++].assign(F.slots[islot]);
+                                NEXT_OP;
+                            }
 
-                vardata_t &rhs_deref(rhs ? rhs->deref() : nullval);
-                vardata_t &lhs_deref(lhs ? lhs->deref() : nullval);
-                vardata_t &result(lhs ? *lhs : *rhs);
+                            // slot not yet bound: resolve by name like an ordinary reference
+                            op = (op == RSREF) ? RREF : LREF;
+                            arg = slot_identifier(arg);
+                        }
 
-                switch (op) {
-                    case RREF:
-                    case LREF:
-                    case LCREF:
-                    case LGREF: {
-                        frame &F = *frames.back();
-                        CHECK_OVERFLOW();
                         CHECK_IDENTIFIER();
+                        const lk_string &name = bc->identifiers[arg];
 
-                        if (fcallinfo_t *fci = F.env.lookup_func(bc->identifiers[arg])) {
+                        if (fcallinfo_t *fci = F.env.lookup_func(name)) {
                             stack[sp++].assign_fcall(fci);
-                        } else if (vardata_t *x1 = F.env.lookup(bc->identifiers[arg], op == RREF)) {
+                            NEXT_OP;
+                        }
+
+                        // variables inherited through a tail call are treated as the parent frame's
+                        vardata_t *x0 = F.env.lookup(name, false), *x1 = 0;
+                        if (x0 && is_inherited(F, x0))
+                            std::swap(x0, x1);
+
+                        if (x0) {
+                            // only variables owned by this frame are bound to a slot
+                            if (slotted) {
+                                if (islot >= F.slots.size()) F.slots.resize(islot + 1, 0);
+                                F.slots[islot] = x0;
+                            }
+                            stack[sp++].assign(x0);
+                        } else if (op == RREF && (x1 || (F.env.parent() && (x1 = F.env.parent()->lookup(name, true))))) {
                             stack[sp++].assign(x1);
+                        } else if (op == LGREF && globals.read_only()) {
+                            // functions run by parallel_call() read the caller's globals from a shared snapshot
+                            return error((const char *) lk_string(
+                                    lk_tr("cannot assign global variable in a parallel call, globals are read only:") + name + "\n").c_str());
                         } else if (op == LREF || op == LCREF || op == LGREF) {
                             // if this is lefthand side lookup, check if the variable
                             // is in the global frame and was created as a global variable
                             // if so, then place it on the stack.  globals are editable from
                             // any context if they were flagged as such when created
-                            vardata_t *x2 = globals.lookup(bc->identifiers[arg], false);
+                            vardata_t *x2 = globals.lookup(name, false);
                             if (x2 && x2->flagval(vardata_t::GLOBALVAL))
                                 stack[sp++].assign(x2);
                             else {
-                                x2 = new vardata_t;
+                                x2 = new_var();
 
                                 // set up flags
                                 if (op == LCREF) {
@@ -274,22 +1338,42 @@ namespace lk {
                                     x2->set_flag(vardata_t::GLOBALVAL);
 
                                 // now insert record
-                                if (op == LGREF) globals.assign(bc->identifiers[arg], x2); // global frame
-                                else F.env.assign(bc->identifiers[arg], x2); // local frame
+                                if (op == LGREF) globals.assign(name, x2); // global frame
+                                else {
+                                    bind_local(F, name, x2); // local frame
+                                    if (slotted) {
+                                        if (islot >= F.slots.size()) F.slots.resize(islot + 1, 0);
+                                        F.slots[islot] = x2;
+                                    }
+                                }
 
                                 stack[sp++].assign(x2);
                             }
                         } else
                             return error((const char *) lk_string(
-                                    lk_tr("referencing unassigned variable:") + bc->identifiers[arg] + "\n").c_str());
+                                    lk_tr("referencing unassigned variable:") + name + "\n").c_str());
 
-                        break;
+                        NEXT_OP;
                     }
 
-                    case CALL:
-                    case TCALL: {
+                    TARGET(CALL):
+                    TARGET(TCALL):
+                    TARGET(TAILCALL): {
                         CHECK_FOR_ARGS(arg + 2);
-                        if (vardata_t::EXTFUNC == rhs_deref.type() && op == CALL) {
+                        vardata_t &rhs_deref = stack[sp - 1].deref();
+
+                        // arguments taken from packed arrays are passed by reference like any other
+                        // array element, but only LK functions can assign to them
+                        size_t argbase = sp - arg - (op == TCALL ? 2 : 1);
+                        while (!elemargs.empty() && elemargs.back().slot >= argbase) {
+                            elemarg &e = elemargs.back();
+                            if (vardata_t::INTFUNC == rhs_deref.type()
+                                && e.arr->type() == vardata_t::VECTOR && e.index < e.arr->length())
+                                stack[e.slot].assign(e.arr->index(e.index));
+                            elemargs.pop_back();
+                        }
+
+                        if (vardata_t::EXTFUNC == rhs_deref.type() && op != TCALL) {
                             frame &F = *frames.back();
                             fcallinfo_t *fci = rhs_deref.fcall();
                             vardata_t &retval = stack[sp - arg - 2];
@@ -308,45 +1392,46 @@ namespace lk {
                             catch (std::exception &e) {
                                 return error(e.what());
                             }
+
+                            // an error reported by the function stops the script, as it does in eval
+                            if (cxt.has_error())
+                                return error("%s", (const char *) cxt.error().c_str());
                         } else if (vardata_t::INTFUNC == rhs_deref.type()) {
-                            frames.push_back(new frame(&frames.back()->env, sp, next_ip, arg));
-                            frame &F = *frames.back();
+                            size_t faddr = rhs_deref.faddr();
+                            if (op == TAILCALL && frames.size() > 1 && tail_call(arg)) {
+                                ENTER_FUNCTION(faddr);
+                                next_ip = faddr;
+                                NEXT_OP;
+                            }
 
-                            vardata_t *__args = new vardata_t;
-                            __args->empty_vector();
+                            if (maxdepth > 0 && frames.size() > maxdepth)
+                                return error((const char *) lk_tr("maximum function call depth of %d exceeded").c_str(),
+                                             (int) maxdepth);
+
+                            env_t *parent = &frames.back()->env;
+                            if (!framepool.empty()) {
+                                frames.push_back(framepool.back());
+                                framepool.pop_back();
+                                frames.back()->reset(parent, sp, next_ip, arg, ip);
+                            } else
+                                frames.push_back(new frame(parent, sp, next_ip, arg, ip));
 
-                            size_t offset = 1;
                             if (op == TCALL) {
-                                offset = 2;
-                                F.env.assign("this", new vardata_t(stack[sp - 2]));
+                                frame &F = *frames.back();
+                                vardata_t *x = new_var();
+                                x->copy(stack[sp - 2]);
+                                F.env.assign("this", x);
                                 F.thiscall = true;
-
-                                if (ip > 2 && PSH == (Opcode) (unsigned char) bc->program[ip - 2]) {
-                                    size_t arg_tmp = (bc->program[ip - 2] >> 8);
-                                    F.id = "->" + bc->constants[arg_tmp].as_string();
-                                } else if (lhs != 0) {
-                                    F.id = "->" + lhs->as_string();
-                                } else F.id = "->???";
-                            } else {
-                                if (ip > 1 && RREF == (Opcode) (unsigned char) bc->program[ip - 1]) {
-                                    size_t arg_tmp = (bc->program[ip - 1] >> 8);
-                                    F.id = bc->identifiers[arg_tmp];
-                                } else
-                                    F.id = "???";
                             }
 
-                            for (size_t i = 0; i < arg; i++)
-                                __args->vec()->push_back(stack[sp - arg - offset + i]);
-
-                            F.env.assign("__args", __args);
-
-                            next_ip = rhs_deref.faddr();
+                            ENTER_FUNCTION(faddr);
+                            next_ip = faddr;
                         } else
                             return error(lk_tr("invalid function access").c_str());
                     }
-                        break;
+                        NEXT_OP;
 
-                    case ARG:
+                    TARGET(ARG):
                         if (frames.size() > 0) {
                             frame &F = *frames.back();
                             if (F.iarg >= F.nargs)
@@ -355,16 +1440,31 @@ namespace lk {
                             size_t offset = F.thiscall ? 2 : 1;
                             size_t idx = F.fp - F.nargs - offset + F.iarg;
 
-                            vardata_t *x = new vardata_t;
+                            CHECK_IDENTIFIER();
+                            vardata_t *x = new_var();
                             x->assign(&stack[idx]);
-                            F.env.assign(bc->identifiers[arg], x);
+                            bind_local(F, bc->identifiers[arg], x);
                             F.iarg++;
                         }
-                        break;
+                        NEXT_OP;
+
+                    TARGET(ARGS):
+                        if (frames.size() > 1) {
+                            frame &F = *frames.back();
+                            size_t offset = F.thiscall ? 2 : 1;
+
+                            vardata_t *__args = new_var();
+                            __args->empty_vector();
+                            for (size_t i = 0; i < F.nargs; i++)
+                                __args->vec()->push_back(stack[F.fp - F.nargs - offset + i]);
+
+                            bind_local(F, "__args", __args);
+                        }
+                        NEXT_OP;
 
-                    case SWI: {
+                    TARGET(SWI): {
                         CHECK_FOR_ARGS(1);
-                        size_t index = rhs_deref.as_unsigned();
+                        size_t index = index_of(stack[sp - 1].deref());
                         size_t noptions = arg;
 
                         if (index >= noptions)
@@ -378,175 +1478,326 @@ namespace lk {
                         // don't need the switch index on the stack any more
                         sp--;
                     }
-                        break;
+                        NEXT_OP;
 
-                    case PSH:
+                    TARGET(PSH):
                         CHECK_OVERFLOW();
                         CHECK_CONSTANT();
                         stack[sp++].copy(bc->constants[arg]);
-                        break;
-                    case POP:
+                        NEXT_OP;
+                    TARGET(POP):
+                        CHECK_FOR_ARGS(1);
                         sp--;
-                        break;
-                    case J:
+                        NEXT_OP;
+                    TARGET(J):
                         next_ip = arg;
-                        break;
-                    case JT:
+                        NEXT_OP;
+                    TARGET(JT): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t &rhs_deref = stack[sp - 1].deref();
                         if (rhs_deref.as_boolean()) next_ip = arg;
                         sp--;
-                        break;
-                    case JF:
+                    }
+                        NEXT_OP;
+                    TARGET(JF): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t &rhs_deref = stack[sp - 1].deref();
                         if (!rhs_deref.as_boolean()) next_ip = arg;
                         sp--;
-                        break;
-                    case IDX: {
+                    }
+                        NEXT_OP;
+                    TARGET(IDX): {
+                        CHECK_FOR_ARGS(2);
+                        vardata_t *lhs = &stack[sp - 2];
+                        size_t index = index_of(stack[sp - 1].deref());
+                        vardata_t &arr = lhs->deref();
+                        // arg is 1 for an element accessed by reference, such as a call argument
+                        bool by_ref = (arg == 1 && lhs->type() == vardata_t::REFERENCE);
+                        if (const std::vector<double> *nv = arr.cnumvec()) {
+                            // packed elements are not variables, push the value itself
+                            if (index >= nv->size())
+                                throw error_t((const char *) lk_tr(
+                                        "array index out of bounds at %d (length: %d)").c_str(),
+                                              (int) index, (int) nv->size());
+                            if (by_ref) {
+                                elemarg e = {(size_t) (sp - 2), &arr, index};
+                                elemargs.push_back(e);
+                            }
+                            double x = (*nv)[index];
+                            if (vardata_t::is_null_num(x)) lhs->nullify();
+                            else if (lhs->type() == vardata_t::REFERENCE) lhs->set_num_value(x);
+                            else lhs->assign(x);
+                        } else if (by_ref)
+                            lhs->assign(arr.index(index));
+                        else
+                            load_element(*lhs, *arr.cindex(index));
+                        sp--;
+                    }
+                        NEXT_OP;
+                    TARGET(LIDX): {
                         CHECK_FOR_ARGS(2);
-                        size_t index = rhs_deref.as_unsigned();
-                        vardata_t &arr = lhs_deref;
-                        bool is_mutable = (arg != 0);
-                        if (is_mutable &&
-                            (arr.type() != vardata_t::VECTOR
-                             || arr.length() <= index))
+                        vardata_t *lhs = &stack[sp - 2];
+                        size_t index = index_of(stack[sp - 1].deref());
+                        vardata_t &arr = lhs->deref();
+                        if (arr.type() != vardata_t::VECTOR || arr.length() <= index)
                             arr.resize(index + 1);
 
                         vardata_t *x = arr.index(index);
-
-                        // if the array is a local directly on the stack, not a reference,
-                        // copy the value before the table is destroyed when it is removed
-                        // from the stack.
-                        if (lhs->type() != lk::vardata_t::REFERENCE) {
-                            vardata_t *cpy = new vardata_t;
-                            cpy->copy(*x);
-                            x = cpy;
+                        if (lhs->type() == vardata_t::REFERENCE)
+                            lhs->assign(x);
+                        else
+                            load_element(*lhs, *x);
+                        sp--;
+                    }
+                        NEXT_OP;
+                    TARGET(KEY): {
+                        CHECK_FOR_ARGS(2);
+                        vardata_t *lhs = &stack[sp - 2];
+                        lk_string kbuf;
+                        const lk_string &key = string_of(stack[sp - 1].deref(), kbuf);
+                        vardata_t &hash = lhs->deref();
+                        // arg is 1 for an entry accessed by reference.  a missing key reads as null
+                        // and is not added to the table
+                        if (arg == 1 && lhs->type() == vardata_t::REFERENCE) {
+                            if (vardata_t *x = hash.lookup(key)) lhs->assign(x);
+                            else lhs->nullify();
+                        } else {
+                            if (const vardata_t *x = hash.clookup(key)) load_element(*lhs, *x);
+                            else lhs->nullify();
                         }
-
-                        result.assign(x);
                         sp--;
                     }
-                        break;
-                    case KEY: {
+                        NEXT_OP;
+                    TARGET(LKEY): {
                         CHECK_FOR_ARGS(2);
-                        lk_string key(rhs_deref.as_string());
-                        vardata_t &hash = lhs_deref;
-                        bool is_mutable = (arg != 0);
-                        if (is_mutable && hash.type() != vardata_t::HASH)
+                        vardata_t *lhs = &stack[sp - 2];
+                        lk_string kbuf;
+                        const lk_string *key = &string_of(stack[sp - 1].deref(), kbuf);
+                        vardata_t &hash = lhs->deref();
+                        if (hash.type() != vardata_t::HASH) {
+                            // the key may be the string that the table replaces
+                            if (key != &kbuf) key = &(kbuf = *key);
                             hash.empty_hash();
-
-                        vardata_t *x = hash.lookup(key);
-                        if (!x) hash.assign(key, x = new vardata_t);
-
-                        // if the table is a local directly on the stack, not a reference,
-                        // copy the value before the table is destroyed when it is removed
-                        // from the stack.
-                        if (lhs->type() != lk::vardata_t::REFERENCE) {
-                            vardata_t *cpy = new vardata_t;
-                            cpy->copy(*x);
-                            x = cpy;
                         }
 
-                        result.assign(x);
+                        vardata_t *x = hash.lookup(*key);
+                        if (!x) x = &hash.hash_item(*key);
+
+                        if (lhs->type() == vardata_t::REFERENCE)
+                            lhs->assign(x);
+                        else
+                            load_element(*lhs, *x);
                         sp--;
                     }
-                        break;
+                        NEXT_OP;
 
-                    case ADD:
+                    TARGET(ADD): {
                         CHECK_FOR_ARGS(2);
-                        if (lhs_deref.type() == vardata_t::STRING || rhs_deref.type() == vardata_t::STRING)
-                            result.assign(lhs_deref.as_string() + rhs_deref.as_string());
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(lhs_deref.num_value() + rhs_deref.num_value());
+                        else if (lhs_deref.type() == vardata_t::STRING || rhs_deref.type() == vardata_t::STRING)
+                            concat(result, lhs_deref, rhs_deref);
                         else
                             result.assign(lhs_deref.num() + rhs_deref.num());
                         sp--;
-                        break;
-                    case SUB:
+                    }
+                        NEXT_OP;
+                    TARGET(SUB): {
                         CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.num() - rhs_deref.num());
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(lhs_deref.num_value() - rhs_deref.num_value());
+                        else
+                            result.assign(lhs_deref.num() - rhs_deref.num());
                         sp--;
-                        break;
-                    case MUL:
+                    }
+                        NEXT_OP;
+                    TARGET(MUL): {
                         CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.num() * rhs_deref.num());
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(lhs_deref.num_value() * rhs_deref.num_value());
+                        else
+                            result.assign(lhs_deref.num() * rhs_deref.num());
                         sp--;
-                        break;
-                    case DIV:
+                    }
+                        NEXT_OP;
+                    TARGET(DIV): {
                         CHECK_FOR_ARGS(2);
-                        if (rhs_deref.num() == 0.0)
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(rhs_deref.num_value() == 0.0 ? std::numeric_limits<double>::quiet_NaN()
+                                                                               : lhs_deref.num_value() / rhs_deref.num_value());
+                        else if (rhs_deref.num() == 0.0)
                             result.assign(std::numeric_limits<double>::quiet_NaN());
                         else
                             result.assign(lhs_deref.num() / rhs_deref.num());
                         sp--;
-                        break;
-                    case EXP:
+                    }
+                        NEXT_OP;
+                    TARGET(ADDN):
+                        // operands proven to be numbers by codegen, see number_op().  only verified
+                        // bytecode skips the type checks, anything else runs the base instruction
+                        if (!verified)
+                            DISPATCH_BASE();
+                        stack[sp - 2].set_num_value(stack[sp - 2].deref().num_value() + stack[sp - 1].deref().num_value());
+                        sp--;
+                        NEXT_OP;
+                    TARGET(SUBN):
+                        if (!verified)
+                            DISPATCH_BASE();
+                        stack[sp - 2].set_num_value(stack[sp - 2].deref().num_value() - stack[sp - 1].deref().num_value());
+                        sp--;
+                        NEXT_OP;
+                    TARGET(MULN):
+                        if (!verified)
+                            DISPATCH_BASE();
+                        stack[sp - 2].set_num_value(stack[sp - 2].deref().num_value() * stack[sp - 1].deref().num_value());
+                        sp--;
+                        NEXT_OP;
+                    TARGET(DIVN): {
+                        if (!verified)
+                            DISPATCH_BASE();
+                        double rhs = stack[sp - 1].deref().num_value();
+                        stack[sp - 2].set_num_value(rhs == 0.0 ? std::numeric_limits<double>::quiet_NaN()
+                                                               : stack[sp - 2].deref().num_value() / rhs);
+                        sp--;
+                    }
+                        NEXT_OP;
+                    TARGET(LTN):
+                    TARGET(GTN):
+                    TARGET(LEN):
+                    TARGET(GEN):
+                    TARGET(NEN):
+                    TARGET(EQN):
+                        if (!verified)
+                            DISPATCH_BASE();
+                        stack[sp - 2].set_num_value(compare_num(base_op(op), stack[sp - 2].deref().num_value(),
+                                                                stack[sp - 1].deref().num_value()) ? 1.0 : 0.0);
+                        sp--;
+                        NEXT_OP;
+                    TARGET(EXP): {
                         CHECK_FOR_ARGS(2);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
                         result.assign(::pow(lhs_deref.num(), rhs_deref.num()));
                         sp--;
-                        break;
-                    case LT:
+                    }
+                        NEXT_OP;
+                    TARGET(LT): {
                         CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.lessthan(rhs_deref) ? 1.0 : 0.0);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(compare_num(LT, lhs_deref.num_value(), rhs_deref.num_value()) ? 1.0 : 0.0);
+                        else
+                            result.assign(lhs_deref.lessthan(rhs_deref) ? 1.0 : 0.0);
                         sp--;
-                        break;
-                    case LE:
+                    }
+                        NEXT_OP;
+                    TARGET(LE): {
                         CHECK_FOR_ARGS(2);
-                        result.assign((lhs_deref.lessthan(rhs_deref)
-                                       || lhs_deref.equals(rhs_deref)) ? 1.0 : 0.0);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(compare_num(LE, lhs_deref.num_value(), rhs_deref.num_value()) ? 1.0 : 0.0);
+                        else
+                            result.assign((lhs_deref.lessthan(rhs_deref)
+                                           || lhs_deref.equals(rhs_deref)) ? 1.0 : 0.0);
                         sp--;
-                        break;
-                    case GT:
+                    }
+                        NEXT_OP;
+                    TARGET(GT): {
                         CHECK_FOR_ARGS(2);
-                        result.assign((!lhs_deref.lessthan(rhs_deref)
-                                       && !lhs_deref.equals(rhs_deref)) ? 1.0 : 0.0);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(compare_num(GT, lhs_deref.num_value(), rhs_deref.num_value()) ? 1.0 : 0.0);
+                        else
+                            result.assign((!lhs_deref.lessthan(rhs_deref)
+                                           && !lhs_deref.equals(rhs_deref)) ? 1.0 : 0.0);
                         sp--;
-                        break;
-                    case GE:
+                    }
+                        NEXT_OP;
+                    TARGET(GE): {
                         CHECK_FOR_ARGS(2);
-                        result.assign(!(lhs_deref.lessthan(rhs_deref)) ? 1.0 : 0.0);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(compare_num(GE, lhs_deref.num_value(), rhs_deref.num_value()) ? 1.0 : 0.0);
+                        else
+                            result.assign(!(lhs_deref.lessthan(rhs_deref)) ? 1.0 : 0.0);
                         sp--;
-                        break;
-                    case EQ:
+                    }
+                        NEXT_OP;
+                    TARGET(EQ): {
                         CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.equals(rhs_deref) ? 1.0 : 0.0);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(compare_num(EQ, lhs_deref.num_value(), rhs_deref.num_value()) ? 1.0 : 0.0);
+                        else
+                            result.assign(lhs_deref.equals(rhs_deref) ? 1.0 : 0.0);
                         sp--;
-                        break;
-                    case NE:
+                    }
+                        NEXT_OP;
+                    TARGET(NE): {
                         CHECK_FOR_ARGS(2);
-                        result.assign(lhs_deref.equals(rhs_deref) ? 0.0 : 1.0);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(compare_num(NE, lhs_deref.num_value(), rhs_deref.num_value()) ? 1.0 : 0.0);
+                        else
+                            result.assign(lhs_deref.equals(rhs_deref) ? 0.0 : 1.0);
                         sp--;
-                        break;
-                    case OR:
+                    }
+                        NEXT_OP;
+                    TARGET(OR): {
                         CHECK_FOR_ARGS(2);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
                         result.assign((((int) lhs_deref.num()) || ((int) rhs_deref.num())) ? 1 : 0);
                         sp--;
-                        break;
-                    case AND:
+                    }
+                        NEXT_OP;
+                    TARGET(AND): {
                         CHECK_FOR_ARGS(2);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
                         result.assign((((int) lhs_deref.num()) && ((int) rhs_deref.num())) ? 1 : 0);
                         sp--;
-                        break;
-                    case INC:
+                    }
+                        NEXT_OP;
+                    TARGET(INC): {
                         CHECK_FOR_ARGS(1);
-                        rhs_deref.assign(rhs_deref.num() + 1.0);
-                        break;
-                    case DEC:
+                        vardata_t &rhs_deref = stack[sp - 1].deref();
+                        if (rhs_deref.is_plain_num())
+                            rhs_deref.set_num_value(rhs_deref.num_value() + 1.0);
+                        else
+                            rhs_deref.assign(rhs_deref.num() + 1.0);
+                    }
+                        NEXT_OP;
+                    TARGET(DEC): {
                         CHECK_FOR_ARGS(1);
-                        rhs_deref.assign(rhs_deref.num() - 1.0);
-                        break;
-                    case NOT:
+                        vardata_t &rhs_deref = stack[sp - 1].deref();
+                        if (rhs_deref.is_plain_num())
+                            rhs_deref.set_num_value(rhs_deref.num_value() - 1.0);
+                        else
+                            rhs_deref.assign(rhs_deref.num() - 1.0);
+                    }
+                        NEXT_OP;
+                    TARGET(NOT): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t *rhs = &stack[sp - 1];
+                        vardata_t &rhs_deref = rhs->deref();
                         rhs->assign(((int) rhs_deref.num()) ? 0.0 : 1.0);
-                        break;
-                    case NEG:
+                    }
+                        NEXT_OP;
+                    TARGET(NEG): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t *rhs = &stack[sp - 1];
+                        vardata_t &rhs_deref = rhs->deref();
                         rhs->assign(0.0 - rhs_deref.num());
-                        break;
-                    case MAT:
+                    }
+                        NEXT_OP;
+                    TARGET(MAT): {
                         CHECK_FOR_ARGS(2);
+                        vardata_t &lhs_deref = stack[sp - 2].deref(), &rhs_deref = stack[sp - 1].deref();
                         if (lhs_deref.type() == vardata_t::HASH) {
-                            lk::varhash_t *hh = lhs_deref.hash();
-                            lk::varhash_t::iterator it = hh->find(rhs_deref.as_string());
-                            if (it != hh->end())
-                                hh->erase(it);
+                            lk_string kbuf;
+                            lhs_deref.hash()->erase(string_of(rhs_deref, kbuf));
                         } else if (lhs_deref.type() == vardata_t::VECTOR) {
                             std::vector<lk::vardata_t> *vv = lhs_deref.vec();
                             size_t idx = rhs_deref.as_unsigned();
@@ -556,15 +1807,19 @@ namespace lk {
                             return error(lk_tr("-@ requires a hash or vector").c_str());
 
                         sp--;
-                        break;
+                    }
+                        NEXT_OP;
 
-                    case WAT:
+                    TARGET(WAT): {
+                        CHECK_FOR_ARGS(2);
+                        vardata_t &result = stack[sp - 2], &lhs_deref = result.deref(), &rhs_deref = stack[sp - 1].deref();
                         if (lhs_deref.type() == vardata_t::HASH) {
-                            lk::varhash_t *hh = lhs_deref.hash();
-                            result.assign(hh->find(rhs_deref.as_string()) != hh->end() ? 1.0 : 0.0);
+                            const lk::varhash_t *hh = lhs_deref.chash();
+                            lk_string kbuf;
+                            result.assign(hh->find(string_of(rhs_deref, kbuf)) != hh->end() ? 1.0 : 0.0);
                         } else if (lhs_deref.type() == vardata_t::VECTOR) {
                             result.assign(-1.0);
-                            std::vector<lk::vardata_t> *vv = lhs_deref.vec();
+                            const std::vector<lk::vardata_t> *vv = lhs_deref.cvec();
                             for (size_t i = 0; i < vv->size(); i++) {
                                 if ((*vv)[i].equals(rhs_deref)) {
                                     result.assign((double) i);
@@ -572,34 +1827,40 @@ namespace lk {
                                 }
                             }
                         } else if (lhs_deref.type() == vardata_t::STRING) {
-                            lk_string::size_type pos = lhs_deref.str().find(rhs_deref.as_string());
+                            lk_string kbuf;
+                            lk_string::size_type pos = lhs_deref.str().find(string_of(rhs_deref, kbuf));
                             result.assign(pos != lk_string::npos ? (int) pos : -1.0);
                         } else
                             return error(lk_tr("?@ requires a hash, vector, or string").c_str());
 
                         sp--;
-                        break;
+                    }
+                        NEXT_OP;
 
-                    case GET:
+                    TARGET(GET):
                         CHECK_OVERFLOW();
                         CHECK_IDENTIFIER();
                         if (!special_get(bc->identifiers[arg], stack[sp++]))
                             return error((const char *) lk_string(
                                     lk_tr("failed to read external value") + " '" + bc->identifiers[arg] +
                                     "'").c_str());
-                        break;
+                        NEXT_OP;
 
-                    case SET:
+                    TARGET(SET): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t &rhs_deref = stack[sp - 1].deref();
                         CHECK_IDENTIFIER();
                         if (!special_set(bc->identifiers[arg], rhs_deref))
                             return error((const char *) lk_string(
                                     lk_tr("failed to write external value") + " '" + bc->identifiers[arg] +
                                     "'").c_str());
                         sp--;
-                        break;
-                    case SZ:
+                    }
+                        NEXT_OP;
+                    TARGET(SZ): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t *rhs = &stack[sp - 1];
+                        vardata_t &rhs_deref = rhs->deref();
                         if (rhs_deref.type() == vardata_t::VECTOR)
                             rhs->assign((int) rhs_deref.length());
                         else if (rhs_deref.type() == vardata_t::STRING)
@@ -607,39 +1868,45 @@ namespace lk {
                         else if (rhs_deref.type() == vardata_t::HASH) {
                             int count = 0;
 
-                            varhash_t *h = rhs_deref.hash();
-                            for (varhash_t::iterator it = h->begin();
+                            const varhash_t *h = rhs_deref.chash();
+                            for (varhash_t::const_iterator it = h->begin();
                                  it != h->end();
                                  ++it) {
-                                if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                                if ((*it).second.deref().type() != vardata_t::NULLVAL)
                                     count++;
                             }
                             rhs->assign(count);
                         } else
                             return error(lk_tr("operand to sizeof must be a array, string, or table type").c_str());
 
-                        break;
-                    case KEYS:
+                    }
+                        NEXT_OP;
+                    TARGET(KEYS): {
                         CHECK_FOR_ARGS(1);
+                        vardata_t *rhs = &stack[sp - 1];
+                        vardata_t &rhs_deref = rhs->deref();
                         if (rhs_deref.type() == vardata_t::HASH) {
-                            varhash_t *h = rhs_deref.hash();
+                            const varhash_t *h = rhs_deref.chash();
 
                             lk::vardata_t keys;
                             keys.empty_vector();
                             keys.vec()->reserve(h->size());
-                            for (varhash_t::iterator it = h->begin();
+                            for (varhash_t::const_iterator it = h->begin();
                                  it != h->end();
                                  ++it) {
-                                if ((*it).second->deref().type() != vardata_t::NULLVAL)
+                                if ((*it).second.deref().type() != vardata_t::NULLVAL)
                                     keys.vec_append((*it).first);
                             }
                             rhs->copy(keys);
                         } else
                             return error(lk_tr("operand to @ (keysof) must be a table").c_str());
 
-                        break;
-                    case WR: {
+                    }
+                        NEXT_OP;
+                    TARGET(WR): {
                         CHECK_FOR_ARGS(2);
+                        vardata_t *rhs = &stack[sp - 1];
+                        vardata_t &lhs_deref = stack[sp - 2].deref(), &rhs_deref = rhs->deref();
                         // copy the value into a temporary first in case
                         // the reference being assigned will erase the value
                         //   e.g.    x = [ 1, 2, 3 ];  x = x[1];
@@ -649,15 +1916,52 @@ namespace lk {
                         // until after the copy is complete...
                         lk::vardata_t temp;
                         temp.copy(lhs_deref);
-                        rhs_deref.copy(temp);
+                        if (assigns_variable(bc, ip, *rhs)) rhs_deref.copy(temp);
+                        else rhs_deref.store(temp);
 
                         // refresh the reference on the stack to the newly assigned value
                         stack[sp - 2].assign(rhs);
                         sp--;
-                        break;
                     }
+                        NEXT_OP;
+
+                    TARGET(ADDEQ):
+                    TARGET(SUBEQ):
+                    TARGET(MULEQ):
+                    TARGET(DIVEQ): {
+                        // the target, pushed after the value, is updated in place: strings and
+                        // arrays are appended to.  leaves a reference to the target as WR does
+                        CHECK_FOR_ARGS(2);
+                        vardata_t &target = stack[sp - 1].deref(), &value = stack[sp - 2].deref();
+                        if (op == ADDEQ && target.type() == vardata_t::VECTOR) {
+                            // an array inside the value is appended a copy of the value, as in  x[0] += x;
+                            vardata_t items(value);
+                            if (!assigns_variable(bc, ip, stack[sp - 1]))
+                                items.unshare_path(&target);
+                            if (items.type() == vardata_t::VECTOR) target.vec_extend(items);
+                            else target.vec_append(items);
+                        } else if (op == ADDEQ && target.type() == vardata_t::STRING) {
+                            lk_string buf;
+                            target.str_append(string_of(value, buf));
+                        } else if (op == ADDEQ && value.type() == vardata_t::STRING)
+                            concat(target, target, value);
+                        else if (op == ADDEQ)
+                            target.assign(target.num() + value.num());
+                        else if (op == SUBEQ)
+                            target.assign(target.num() - value.num());
+                        else if (op == MULEQ)
+                            target.assign(target.num() * value.num());
+                        else if (value.num() == 0.0)
+                            target.assign(std::numeric_limits<double>::quiet_NaN());
+                        else
+                            target.assign(target.num() / value.num());
+
+                        stack[sp - 2].assign(&stack[sp - 1]);
+                        sp--;
+                    }
+                        NEXT_OP;
 
-                    case TYP:
+                    TARGET(TYP):
                         CHECK_OVERFLOW();
                         CHECK_IDENTIFIER();
 
@@ -665,14 +1969,14 @@ namespace lk {
                             stack[sp++].assign(x->deref().typestr());
                         else
                             stack[sp++].assign("unknown");
-                        break;
+                        NEXT_OP;
 
-                    case FREF:
+                    TARGET(FREF):
                         CHECK_OVERFLOW();
                         stack[sp++].assign_faddr(arg);
-                        break;
+                        NEXT_OP;
 
-                    case RET:
+                    TARGET(RET):
                         if (frames.size() > 1) {
                             vardata_t *result_tmp = &stack[sp - 1];
                             frame &F = *frames.back();
@@ -687,66 +1991,192 @@ namespace lk {
                             stack[sp - 1].copy(result_tmp->deref());
                             next_ip = F.retaddr;
 
-                            delete frames.back();
+                            for (size_t i = 0; i < F.retired.size(); i++)
+                                recycle_var(F.retired[i]);
+                            F.retired.clear();
+                            F.inherited.clear();
+                            F.env.release_vars(varpool);
+                            framepool.push_back(&F);
                             frames.pop_back();
                         } else
                             next_ip = code_size;
 
-                        break;
+                        NEXT_OP;
 
-                    case END:
+                    TARGET(END):
                         next_ip = code_size;
-                        break;
+                        NEXT_OP;
 
-                    case NUL:
+                    TARGET(NUL):
                         CHECK_OVERFLOW();
                         stack[sp].nullify();
                         sp++;
-                        break;
+                        NEXT_OP;
 
-                    case DUP:
+                    TARGET(DUP):
                         CHECK_OVERFLOW();
                         CHECK_FOR_ARGS(1);
                         stack[sp].copy(stack[sp - 1]);
                         sp++;
-                        break;
+                        NEXT_OP;
 
-                    case VEC: {
+                    TARGET(VEC): {
                         CHECK_FOR_ARGS(arg);
                         if (arg > 0) {
                             vardata_t &vv = stack[sp - arg];
                             vardata_t save1;
                             save1.copy(vv.deref());
                             vv.empty_vector();
-                            vv.vec()->resize(arg);
-                            vv.index(0)->copy(save1);
+                            vv.vec_append(save1);
                             for (size_t i = 1; i < arg; i++)
-                                vv.index(i)->copy(stack[sp - arg + i].deref());
+                                vv.vec_append(stack[sp - arg + i].deref());
                             sp -= (arg - 1);
                         } else {
                             CHECK_OVERFLOW();
                             stack[sp].empty_vector();
                             sp++;
                         }
-                        break;
+                        NEXT_OP;
                     }
-                    case HASH: {
+                    TARGET(HASH): {
                         size_t N = arg * 2;
                         CHECK_FOR_ARGS(N);
+                        if (N == 0) CHECK_OVERFLOW();
                         vardata_t &vv = stack[sp - N];
                         lk_string key1(vv.deref().as_string());
-                        vv.empty_hash();
-                        if (arg > 0) {
-                            for (size_t i = 0; i < N; i += 2)
-                                vv.hash_item(i == 0 ? key1 :
-                                             stack[sp - N + i].as_string()).copy(
-                                        stack[sp - N + i + 1].deref());
-                        }
+                        vv.empty_hash(arg);
+                        for (size_t i = 0; i < N; i += 2)
+                            vv.hash_item(i == 0 ? key1 : stack[sp - N + i].as_string(),
+                                         stack[sp - N + i + 1].deref());
                         sp -= (N - 1);
-                        break;
                     }
+                        NEXT_OP;
+
+                    TARGET(LTJF):
+                    TARGET(LEJF):
+                    TARGET(GTJF):
+                    TARGET(GEJF):
+                    TARGET(EQJF):
+                    TARGET(NEJF): {
+                        // comparison followed by JF: the jump target is the operand of the JF
+                        if (!verified && ip + 1 >= code_size)
+                            DISPATCH_BASE();
+                        CHECK_FOR_ARGS(2);
+                        vardata_t &lhs_deref = stack[sp - 2].deref(), &rhs_deref = stack[sp - 1].deref();
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER
+                            ? compare_num(base_op(op), lhs_deref.num_value(), rhs_deref.num_value())
+                            : compare(base_op(op), lhs_deref, rhs_deref))
+                            next_ip = ip + 2;
+                        else
+                            next_ip = (bc->program[ip + 1] >> 8);
+                        sp -= 2;
+                    }
+                        NEXT_OP;
+
+                    TARGET(PSHADD):
+                    TARGET(PSHSUB): {
+                        // constant followed by ADD or SUB, applied directly to the top of the stack
+                        CHECK_FOR_ARGS(1);
+                        CHECK_CONSTANT();
+                        vardata_t &result = stack[sp - 1], &lhs_deref = result.deref();
+                        const vardata_t &rhs_deref = bc->constants[arg];
+                        if (lhs_deref.type() == vardata_t::NUMBER && rhs_deref.type() == vardata_t::NUMBER)
+                            result.set_num_value(op == PSHSUB ? lhs_deref.num_value() - rhs_deref.num_value()
+                                                             : lhs_deref.num_value() + rhs_deref.num_value());
+                        else if (op == PSHSUB)
+                            result.assign(lhs_deref.num() - rhs_deref.num());
+                        else if (lhs_deref.type() == vardata_t::STRING || rhs_deref.type() == vardata_t::STRING)
+                            concat(result, lhs_deref, rhs_deref);
+                        else
+                            result.assign(lhs_deref.num() + rhs_deref.num());
+                        next_ip = ip + 2;
+                    }
+                        NEXT_OP;
+
+                    TARGET(INCL):
+                    TARGET(DECL):
+                    TARGET(STL): {
+                        // LSREF followed by INC, DEC or WR and POP, applied to a bound slot in place
+                        frame &F = *frames.back();
+                        size_t islot = slot_index(arg);
+                        if (F.slotrev != F.env.revision() || islot >= F.slots.size() || F.slots[islot] == 0)
+                            DISPATCH_BASE();
+
+                        vardata_t &x = F.slots[islot]->deref();
+                        if (op != STL && x.is_plain_num())
+                            x.set_num_value(x.num_value() + (op == INCL ? 1.0 : -1.0));
+                        else if (op == INCL)
+                            x.assign(x.num() + 1.0);
+                        else if (op == DECL)
+                            x.assign(x.num() - 1.0);
+                        else {
+                            CHECK_FOR_ARGS(1);
+                            // copy through a temporary as WR does, the value may be part of x
+                            lk::vardata_t temp;
+                            temp.copy(stack[sp - 1].deref());
+                            if (F.slots[islot]->type() == vardata_t::REFERENCE) x.store(temp);
+                            else x.copy(temp);
+                            sp--;
+                        }
+                        next_ip = ip + 3;
+                    }
+                        NEXT_OP;
+
+                    TARGET(IDXW): {
+                        // LIDX followed by WR: numbers are stored straight into packed arrays
+                        CHECK_FOR_ARGS(3);
+                        vardata_t &value = stack[sp - 3].deref();
+                        vardata_t &arr = stack[sp - 2].deref();
+                        if (value.type() != vardata_t::NUMBER
+                            || (arr.type() == vardata_t::VECTOR && !arr.cnumvec()))
+                            DISPATCH_BASE();
+
+                        double d = value.num();
+                        arr.set_num(index_of(stack[sp - 1].deref()), d);
+                        stack[sp - 3].assign(d);
+                        sp -= 2;
+                        next_ip = ip + 2;
+                    }
+                        NEXT_OP;
+
+                    TARGET(PSHKEY): {
+                        // constant string key followed by KEY or LKEY on a table reached through a
+                        // reference: tables of the same layout are looked up at the position cached
+                        // for this instruction, anything else takes the general path
+                        CHECK_FOR_ARGS(1);
+                        CHECK_CONSTANT();
+                        vardata_t *lhs = &stack[sp - 1];
+                        vardata_t &hash = lhs->deref();
+                        const vardata_t &key = bc->constants[arg];
+                        if (lhs->type() != vardata_t::REFERENCE || hash.type() != vardata_t::HASH
+                            || key.type() != vardata_t::STRING || ip >= keycaches.size()
+                            || (!verified && ip + 1 >= code_size))
+                            DISPATCH_BASE();
+
+                        keycache &kc = keycaches[ip];
+                        if (!kc.hashed) {
+                            kc.hash = varhash_t::hash_of(key.str());
+                            kc.hashed = true;
+                        }
+
+                        unsigned int access = bc->program[ip + 1];
+                        if ((Opcode) (unsigned char) access == LKEY || (access >> 8) == 1) {
+                            vardata_t *x = hash.hash()->find(key.str(), kc.hash, kc.pos);
+                            if (!x) DISPATCH_BASE();
+                            lhs->assign(x);
+                        } else {
+                            const vardata_t *x = hash.chash()->find(key.str(), kc.hash, kc.pos);
+                            if (x) lhs->copy(x->deref());
+                            else lhs->nullify();
+                        }
+                        next_ip = ip + 2;
+                    }
+                        NEXT_OP;
 
                     default:
+#ifdef LK_COMPUTED_GOTO
+                    L_invalid:
+#endif
                         return error((const char *) lk_string(lk_tr("invalid instruction") + " (0x%02X)").c_str(),
                                      (unsigned int) op);
                 };
@@ -754,11 +2184,12 @@ namespace lk {
                 ip = next_ip;
 
                 nexecuted++;
-                if (mode == SINGLE && nexecuted > 0) return true;
+                if (checked && mode == SINGLE) return true;
+                if (!checked) budget--;
             }
         }
         catch (std::exception &exc) {
-            srcpos_t spos = (ip < bc->debuginfo.size()) ? bc->debuginfo[ip] : srcpos_t::npos;
+            const srcpos_t &spos = position(ip);
 
             return error((const char *) lk_string(lk_tr("runtime exception at") + " %s %d: %s").c_str(),
                          spos.line < 0 ? "ip" : (const char *) lk_string(lk_tr("line")).c_str(),
@@ -770,7 +2201,7 @@ namespace lk {
     }
 
     bool vm::error(const char *fmt, ...) {
-        const srcpos_t &spos = (bc && ip < bc->debuginfo.size()) ? bc->debuginfo[ip] : srcpos_t::npos;
+        const srcpos_t &spos = position(ip);
 
         char buf[512];
         sprintf(buf, "[%d] ", spos.stmt);
@@ -788,18 +2219,25 @@ namespace lk {
     int vm::setbrk(int line, const lk_string &file) {
         if (!bc) return -1;
 
-        for (size_t i = 0; i < bc->debuginfo.size() && i < brkpt.size(); i++) {
-            if (bc->debuginfo[i].file == file
-                && bc->debuginfo[i].line >= line) {
-                // snap the breakpoint to the beginning of the statement
-                while (i > 0
-                       && bc->debuginfo[i - 1].file == bc->debuginfo[i].file
-                       && bc->debuginfo[i - 1].stmt == bc->debuginfo[i].stmt)
-                    i--;
+        int ifile = bc->debuginfo.find_file(file);
+        if (ifile < 0) return -1;
 
-                brkpt[i] = true;
-                return bc->debuginfo[i].stmt;
+        // first instruction of the run of entries making up the current statement
+        size_t stmt_begin = 0, prev_file = (size_t) -1;
+        int prev_stmt = 0;
+        linetable::entry e;
+        for (bool ok = bc->debuginfo.first(e); ok && e.begin < brkpt.size(); ok = bc->debuginfo.next(e)) {
+            if (prev_file != e.file || prev_stmt != e.stmt)
+                stmt_begin = e.begin;
+
+            if (e.file == (size_t) ifile && e.line >= line) {
+                // snap the breakpoint to the beginning of the statement
+                brkpt[stmt_begin] = true;
+                return e.stmt;
             }
+
+            prev_file = e.file;
+            prev_stmt = e.stmt;
         }
 
         return -1;
@@ -811,7 +2249,7 @@ namespace lk {
         if (bc) {
             for (size_t i = 0; i < bc->debuginfo.size() && i < brkpt.size(); i++)
                 if (brkpt[i])
-                    list.push_back(bc->debuginfo[i]);
+                    list.push_back(bc->debuginfo.at(i));
         }
 
         return list;
@@ -821,4 +2259,362 @@ namespace lk {
         for (size_t i = 0; i < brkpt.size(); i++)
             brkpt[i] = false;
     }
+
+    static const char LKB_MAGIC[4] = {'L', 'K', 'B', 0};
+    static const unsigned int LKB_BYTE_ORDER = 0x01020304;
+
+    unsigned long long source_hash(const char *text, size_t len) {
+        unsigned long long h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; i++) {
+            h ^= (unsigned char) text[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    unsigned long long source_hash(const lk_string &text) {
+        std::string utf8 = lk::to_utf8(text);
+        return source_hash(utf8.c_str(), utf8.length());
+    }
+
+    template<typename T>
+    static void put_raw(std::vector<unsigned char> &buf, const T &x) {
+        const unsigned char *p = (const unsigned char *) &x;
+        buf.insert(buf.end(), p, p + sizeof(T));
+    }
+
+    static void put_string(std::vector<unsigned char> &buf, const lk_string &s) {
+        std::string utf8 = lk::to_utf8(s);
+        put_raw(buf, (unsigned int) utf8.length());
+        buf.insert(buf.end(), utf8.begin(), utf8.end());
+    }
+
+/// a packed array is stored as its raw numbers, null elements included
+    static const unsigned char LKB_PACKED = vardata_t::TYPEMASK;
+
+    static bool put_value(std::vector<unsigned char> &buf, const vardata_t &v, lk_string *err) {
+        unsigned char flags = 0;
+        for (unsigned char f = vardata_t::ASSIGNED; f <= vardata_t::GLOBALVAL; f++)
+            if (v.flagval(f)) flags |= 0x01 << f;
+
+        const std::vector<double> *nums = v.type() == vardata_t::VECTOR ? v.cnumvec() : 0;
+        buf.push_back(nums ? LKB_PACKED : v.type());
+        buf.push_back(flags);
+
+        switch (v.type()) {
+            case vardata_t::NULLVAL:
+                return true;
+            case vardata_t::NUMBER:
+                put_raw(buf, v.num());
+                return true;
+            case vardata_t::STRING:
+                put_string(buf, v.str());
+                return true;
+            case vardata_t::VECTOR:
+                if (nums) {
+                    put_raw(buf, (unsigned int) nums->size());
+                    for (size_t i = 0; i < nums->size(); i++)
+                        put_raw(buf, (*nums)[i]);
+                } else {
+                    const std::vector<vardata_t> *vv = v.cvec();
+                    put_raw(buf, (unsigned int) vv->size());
+                    for (size_t i = 0; i < vv->size(); i++)
+                        if (!put_value(buf, (*vv)[i], err))
+                            return false;
+                }
+                return true;
+            case vardata_t::HASH: {
+                const varhash_t *h = v.chash();
+                put_raw(buf, (unsigned int) h->size());
+                for (varhash_t::const_iterator it = h->begin(); it != h->end(); ++it) {
+                    put_string(buf, it->first);
+                    if (!put_value(buf, it->second, err))
+                        return false;
+                }
+                return true;
+            }
+            default:
+                if (err) *err = "cannot serialize constant of type " + lk_string(v.typestr());
+                return false;
+        }
+    }
+
+    bool write_bytecode(const bytecode &b, unsigned long long hash, std::vector<unsigned char> &buf,
+                        lk_string *err) {
+        buf.clear();
+        for (size_t i = 0; i < sizeof(LKB_MAGIC); i++)
+            buf.push_back((unsigned char) LKB_MAGIC[i]);
+        put_raw(buf, LKB_VERSION);
+        put_raw(buf, LKB_BYTE_ORDER);
+        put_raw(buf, hash);
+
+        put_raw(buf, (unsigned int) b.program.size());
+        if (!b.program.empty()) {
+            const unsigned char *p = (const unsigned char *) &b.program[0];
+            buf.insert(buf.end(), p, p + b.program.size() * sizeof(unsigned int));
+        }
+
+        put_raw(buf, (unsigned int) b.constants.size());
+        for (size_t i = 0; i < b.constants.size(); i++)
+            if (!put_value(buf, b.constants[i], err))
+                return false;
+
+        put_raw(buf, (unsigned int) b.identifiers.size());
+        for (size_t i = 0; i < b.identifiers.size(); i++)
+            put_string(buf, b.identifiers[i]);
+
+        const std::vector<lk_string> &files = b.debuginfo.files();
+        const std::vector<unsigned char> &lines = b.debuginfo.data();
+        put_raw(buf, (unsigned int) b.debuginfo.size());
+        put_raw(buf, (unsigned int) files.size());
+        for (size_t i = 0; i < files.size(); i++)
+            put_string(buf, files[i]);
+        put_raw(buf, (unsigned int) lines.size());
+        buf.insert(buf.end(), lines.begin(), lines.end());
+
+        return true;
+    }
+
+    bool write_bytecode(const bytecode &b, unsigned long long hash, const lk_string &file, lk_string *err) {
+        std::vector<unsigned char> buf;
+        if (!write_bytecode(b, hash, buf, err))
+            return false;
+
+        FILE *fp = fopen((const char *) file.c_str(), "wb");
+        if (!fp) {
+            if (err) *err = "could not write " + file;
+            return false;
+        }
+
+        bool ok = fwrite(&buf[0], 1, buf.size(), fp) == buf.size();
+        ok = (fclose(fp) == 0) && ok;
+        if (!ok && err) *err = "could not write " + file;
+        return ok;
+    }
+
+/// bounds checked cursor over a serialized buffer, fails sticky on overrun
+    class lkb_reader {
+    public:
+        lkb_reader(const unsigned char *data, size_t len) : m_p(data), m_end(data + len), m_ok(true) {}
+
+        bool ok() const { return m_ok; }
+
+        /// marks the data as invalid, so that nothing more is read from it
+        void fail() { m_ok = false; }
+
+        const unsigned char *take(size_t n) {
+            if (!m_ok || (size_t) (m_end - m_p) < n) {
+                m_ok = false;
+                return 0;
+            }
+            const unsigned char *p = m_p;
+            m_p += n;
+            return p;
+        }
+
+        template<typename T>
+        bool get(T &x) {
+            const unsigned char *p = take(sizeof(T));
+            if (p) memcpy(&x, p, sizeof(T));
+            return p != 0;
+        }
+
+        bool get(lk_string &s) {
+            unsigned int n = 0;
+            const unsigned char *p = get(n) ? take(n) : 0;
+            if (p) s = lk::from_utf8(std::string((const char *) p, n));
+            return p != 0;
+        }
+
+        /// reads an element count, rejecting counts that cannot fit in the rest of the buffer
+        bool count(unsigned int &n, size_t min_size) {
+            if (get(n) && (size_t) (m_end - m_p) / min_size < n)
+                m_ok = false;
+            return m_ok;
+        }
+
+    private:
+        const unsigned char *m_p;
+        const unsigned char *m_end;
+        bool m_ok;
+    };
+
+    static bool get_value(lkb_reader &in, vardata_t &v) {
+        unsigned char type = 0, flags = 0;
+        unsigned int n = 0;
+        if (!in.get(type) || !in.get(flags))
+            return false;
+
+        switch (type) {
+            case vardata_t::NULLVAL:
+                v.nullify();
+                break;
+            case vardata_t::NUMBER: {
+                double d = 0;
+                if (!in.get(d)) return false;
+                v.assign(d);
+                break;
+            }
+            case vardata_t::STRING: {
+                lk_string s;
+                if (!in.get(s)) return false;
+                v.assign(s);
+                break;
+            }
+            case LKB_PACKED: {
+                if (!in.count(n, sizeof(double))) return false;
+                std::vector<double> nums(n);
+                for (unsigned int i = 0; i < n; i++)
+                    in.get(nums[i]);
+                v.vec_assign(n > 0 ? &nums[0] : 0, n);
+                break;
+            }
+            case vardata_t::VECTOR: {
+                if (!in.count(n, 2)) return false;
+                v.empty_vector();
+                v.vec()->resize(n);
+                for (unsigned int i = 0; i < n; i++)
+                    if (!get_value(in, (*v.vec())[i]))
+                        return false;
+                break;
+            }
+            case vardata_t::HASH: {
+                if (!in.count(n, 6)) return false;
+                v.empty_hash();
+                for (unsigned int i = 0; i < n; i++) {
+                    lk_string key;
+                    vardata_t item;
+                    if (!in.get(key) || !get_value(in, item))
+                        return false;
+                    v.hash_item(key, item);
+                }
+                break;
+            }
+            default:
+                return false;
+        }
+
+        for (unsigned char f = vardata_t::ASSIGNED; f <= vardata_t::GLOBALVAL; f++)
+            if (flags & (0x01 << f))
+                v.set_flag(f);
+
+        return in.ok();
+    }
+
+    bool read_bytecode(const unsigned char *data, size_t len, bytecode &b, unsigned long long *hash,
+                       lk_string *err) {
+        lkb_reader in(data, len);
+        unsigned int version = 0, order = 0, n = 0;
+        unsigned long long h = 0;
+        const unsigned char *magic = in.take(4);
+
+        if (!magic || memcmp(magic, LKB_MAGIC, 4) != 0) {
+            if (err) *err = "not an lk bytecode file";
+            return false;
+        }
+
+        if (!in.get(version) || !in.get(order) || !in.get(h)
+            || version != LKB_VERSION || order != LKB_BYTE_ORDER) {
+            if (err) *err = "unsupported lk bytecode version";
+            return false;
+        }
+
+        if (hash) *hash = h;
+
+        b.program.clear();
+        b.constants.clear();
+        b.identifiers.clear();
+        b.debuginfo.clear();
+        b.verified = false;
+
+        if (in.count(n, sizeof(unsigned int))) {
+            b.program.resize(n);
+            if (const unsigned char *p = in.take(n * sizeof(unsigned int)))
+                memcpy(b.program.data(), p, n * sizeof(unsigned int));
+
+            // every word must at least name an instruction, and a superinstruction be followed by
+            // those it absorbed, whatever the verifier makes of the rest.  nothing proves the
+            // operands of number-only instructions to be numbers here, so they get the checks back
+            for (size_t i = 0; i < b.program.size(); i++) {
+                Opcode op = (Opcode) (unsigned char) b.program[i];
+                if (op >= __MaxOp || !absorbed(b.program, i, op))
+                    in.fail();
+                else if (base_op(op) != op && number_op(base_op(op)) == op)
+                    b.program[i] = (b.program[i] & 0xFFFFFF00) | (unsigned int) base_op(op);
+            }
+        }
+
+        if (in.count(n, 2)) {
+            b.constants.resize(n);
+            for (unsigned int i = 0; i < n && in.ok(); i++)
+                if (!get_value(in, b.constants[i]))
+                    in.fail();
+        }
+
+        if (in.count(n, sizeof(unsigned int))) {
+            b.identifiers.resize(n);
+            for (unsigned int i = 0; i < n && in.ok(); i++)
+                in.get(b.identifiers[i]);
+        }
+
+        unsigned int size = 0;
+        std::vector<lk_string> files;
+        if (in.get(size) && in.count(n, sizeof(unsigned int))) {
+            files.resize(n);
+            for (unsigned int i = 0; i < n && in.ok(); i++)
+                in.get(files[i]);
+        }
+
+        const unsigned char *lines = in.count(n, 1) ? in.take(n) : 0;
+        if (!lines || size != b.program.size() || !b.debuginfo.assign(lines, n, files, size)) {
+            if (err) *err = "corrupt lk bytecode file";
+            b.program.clear();
+            b.constants.clear();
+            b.identifiers.clear();
+            return false;
+        }
+
+        // the file may not have come from codegen, only run it unchecked once it is proven
+        verify(b);
+        return true;
+    }
+
+    bool load_bytecode(const lk_string &file, bytecode &b, unsigned long long *hash, lk_string *err) {
+#ifdef _WIN32
+        FILE *fp = fopen((const char *) file.c_str(), "rb");
+        if (!fp) {
+            if (err) *err = "could not open " + file;
+            return false;
+        }
+
+        std::vector<unsigned char> buf;
+        unsigned char chunk[4096];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+            buf.insert(buf.end(), chunk, chunk + n);
+        fclose(fp);
+
+        return read_bytecode(buf.empty() ? 0 : &buf[0], buf.size(), b, hash, err);
+#else
+        FILE *fp = fopen((const char *) file.c_str(), "rb");
+        struct stat st;
+        if (!fp || fstat(fileno(fp), &st) != 0) {
+            if (fp) fclose(fp);
+            if (err) *err = "could not open " + file;
+            return false;
+        }
+
+        size_t len = (size_t) st.st_size;
+        void *data = len > 0 ? mmap(0, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0) : MAP_FAILED;
+        fclose(fp);
+        if (data == MAP_FAILED) {
+            if (err) *err = "could not map " + file;
+            return false;
+        }
+
+        bool ok = read_bytecode((const unsigned char *) data, len, b, hash, err);
+        munmap(data, len);
+        return ok;
+#endif
+    }
 } // namespace lk;